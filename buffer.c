@@ -21,301 +21,500 @@
 #include "mtools.h"
 #include "buffer.h"
 
+/*
+ * The buffer is a cache of fixed size blocks (one "cylinder" each),
+ * looked up through a small hash table and evicted using the CLOCK
+ * algorithm.  Each block is filled from its start, and remembers
+ * which part of it needs to be written back.
+ */
+
+#define NO_BLOCK ((size_t) -1)
+
+/* upper limit for sequential readahead, in bytes */
+#define MAX_READAHEAD (4 << 20)
+
+typedef struct Block_t {
+	mt_off_t start;		/* position of block on disk */
+	char *data;
+	size_t valid;		/* number of bytes loaded from start */
+	int dirty;		/* does block need to be written back? */
+	size_t dirty_pos;
+	size_t dirty_end;
+	int referenced;		/* used since last pass of clock hand */
+	size_t next;		/* next block in hash chain */
+} Block_t;
+
 typedef struct Buffer_t {
 	struct Stream_t head;
 
-	size_t size;     	/* size of read/write buffer */
-	int dirty;	       	/* is the buffer dirty? */
-
 	size_t sectorSize;	/* sector size: all operations happen
 				 * in multiples of this */
-	size_t cylinderSize;	/* cylinder size: preferred alignment,
-				 * but for efficiency, less data may be read */
+	size_t cylinderSize;	/* cylinder size: size of one block */
 	int ever_dirty;	       	/* was the buffer ever dirty? */
-	size_t dirty_pos;
-	size_t dirty_end;
-	mt_off_t current;	/* first sector in buffer */
-	size_t cur_size;	/* the current size */
-	char *buf;		/* disk read/write buffer */
+
+	Block_t *blocks;
+	size_t nrBlocks;	/* capacity, in blocks */
+	size_t usedBlocks;	/* blocks which have data allocated */
+	size_t hand;		/* clock hand, for eviction */
+
+	size_t *hash;		/* first block of each hash chain */
+	size_t hashSize;	/* power of two */
+
+	mt_off_t seqEnd;	/* end of last read */
+	size_t raBlocks;	/* readahead window, in blocks.  0 means
+				 * random access: only read what is
+				 * asked for */
+	size_t maxRaBlocks;
+	char *raBuf;		/* staging area for readahead */
+	size_t raBufSize;
 } Buffer_t;
 
-/* Convert position relative to buffer to absolute position */
-static mt_off_t abs_pos(Buffer_t *Buffer, size_t rel) {
-	return Buffer->current + (mt_off_t) rel;
+static size_t hashBucket(Buffer_t *Buffer, mt_off_t start)
+{
+	uint64_t key = (uint64_t) (start / (mt_off_t) Buffer->cylinderSize);
+	return (size_t) ((key * 0x9e3779b97f4a7c15ull) >> 32) &
+		(Buffer->hashSize - 1);
 }
 
-/* End of currently valid buffer */
-static mt_off_t cur_end(Buffer_t *Buffer) {
-	return abs_pos(Buffer, Buffer->cur_size);
+static Block_t *findBlock(Buffer_t *Buffer, mt_off_t start)
+{
+	size_t i;
+
+	for(i = Buffer->hash[hashBucket(Buffer, start)];
+	    i != NO_BLOCK;
+	    i = Buffer->blocks[i].next)
+		if(Buffer->blocks[i].start == start)
+			return &Buffer->blocks[i];
+	return NULL;
 }
 
-/* distance from absolute position until next full cylinder. If position already
- * *is* on a full cylinder boundary, return size of full cylinder */
-static size_t pos_to_next_full_cyl(Buffer_t *Buffer, mt_off_t pos) {
-	return Buffer->cylinderSize -
-		(size_t) (pos % (mt_off_t) Buffer->cylinderSize);
+static void unhashBlock(Buffer_t *Buffer, Block_t *block)
+{
+	size_t *p;
+
+	for(p = &Buffer->hash[hashBucket(Buffer, block->start)];
+	    *p != NO_BLOCK;
+	    p = &Buffer->blocks[*p].next)
+		if(&Buffer->blocks[*p] == block) {
+			*p = block->next;
+			return;
+		}
 }
 
 /*
- * Flush a dirty buffer to disk.  Resets Buffer->dirty to zero.
+ * Write back the dirty part of a block.  Resets block->dirty to zero.
  * All errors are fatal.
  */
-
-static int _buf_flush(Buffer_t *Buffer)
+static int writeBlock(Buffer_t *Buffer, Block_t *block)
 {
 	ssize_t ret;
 
 #ifdef HAVE_ASSERT_H
 	assert(Buffer->head.Next != NULL);
 #endif
-	
-	if (!Buffer->dirty)
+
+	if (!block->dirty)
 		return 0;
 #ifdef DEBUG
 	fprintf(stderr, "write %08x -- %02x %08x %08x\n",
 		Buffer,
-		(unsigned char) Buffer->buf[0],
-		Buffer->current + Buffer->dirty_pos,
-		Buffer->dirty_end - Buffer->dirty_pos);
+		(unsigned char) block->data[0],
+		block->start + block->dirty_pos,
+		block->dirty_end - block->dirty_pos);
 #endif
 
 	ret = force_pwrite(Buffer->head.Next,
-			   Buffer->buf + Buffer->dirty_pos,
-			   Buffer->current + (mt_off_t) Buffer->dirty_pos,
-			   Buffer->dirty_end - Buffer->dirty_pos);
+			   block->data + block->dirty_pos,
+			   block->start + (mt_off_t) block->dirty_pos,
+			   block->dirty_end - block->dirty_pos);
 	if(ret < 0) {
 		perror("buffer_flush: write");
 		return -1;
 	}
-	
-	if((size_t) ret != Buffer->dirty_end - Buffer->dirty_pos) {
+
+	if((size_t) ret != block->dirty_end - block->dirty_pos) {
 		fprintf(stderr,"buffer_flush: short write\n");
 		return -1;
 	}
-	Buffer->dirty = 0;
-	Buffer->dirty_end = 0;
-	Buffer->dirty_pos = 0;
+	block->dirty = 0;
+	block->dirty_end = 0;
+	block->dirty_pos = 0;
 	return 0;
 }
 
-static int invalidate_buffer(Buffer_t *Buffer, mt_off_t start)
+/*
+ * Pick a block to hold the data at start (which is block aligned),
+ * writing back its previous contents if needed.  Returns an empty
+ * block, or NULL on error
+ */
+static Block_t *allocBlock(Buffer_t *Buffer, mt_off_t start)
 {
-	if(_buf_flush(Buffer) < 0)
-		return -1;
+	Block_t *block = NULL;
+
+	if(Buffer->usedBlocks < Buffer->nrBlocks) {
+		block = &Buffer->blocks[Buffer->usedBlocks];
+		block->data = malloc(Buffer->cylinderSize);
+		if(block->data)
+			Buffer->usedBlocks++;
+		else if(Buffer->usedBlocks)
+			/* make do with what we already have */
+			Buffer->nrBlocks = Buffer->usedBlocks;
+		else {
+			perror("buffer: allocate block");
+			return NULL;
+		}
+	}
+
+	if(!block || !block->data) {
+		/* clock: evict the first block which hasn't been used
+		 * since the hand last went past */
+		while(1) {
+			block = &Buffer->blocks[Buffer->hand];
+			Buffer->hand = (Buffer->hand + 1) % Buffer->usedBlocks;
+			if(!block->referenced)
+				break;
+			block->referenced = 0;
+		}
+		if(writeBlock(Buffer, block) < 0)
+			return NULL;
+		unhashBlock(Buffer, block);
+	}
+
+	block->start = start;
+	block->valid = 0;
+	block->dirty = 0;
+	block->dirty_pos = 0;
+	block->dirty_end = 0;
+	block->referenced = 1;
+	block->next = Buffer->hash[hashBucket(Buffer, start)];
+	Buffer->hash[hashBucket(Buffer, start)] =
+		(size_t) (block - Buffer->blocks);
+	return block;
+}
+
+/*
+ * Read from start into buf until size bytes are there, or the end of
+ * the underlying stream is reached.  Returns number of bytes read,
+ * rounded down to whole sectors
+ */
+static ssize_t readFully(Buffer_t *Buffer, char *buf, mt_off_t start,
+			 size_t size)
+{
+	ssize_t ret;
+	size_t done = 0;
+
+	while(done < size) {
+		ret = PREADS(Buffer->head.Next, buf + done,
+			     start + (mt_off_t) done, size - done);
+		if(ret < 0)
+			return -1;
+		if(ret == 0)
+			break;
+		done += (size_t) ret;
+	}
+	if(done % Buffer->sectorSize) {
+		fprintf(stderr, "Weird: read size ("SSZF") not a multiple of sector size (%d)\n",
+			done, (int) Buffer->sectorSize);
+		done -= done % Buffer->sectorSize;
+	}
+	return (ssize_t) done;
+}
 
-	/* start reading at the beginning of start's sector
-	 * don't start reading too early, or we might not even reach
-	 * start */
-	Buffer->current = ROUND_DOWN(start, (mt_off_t) Buffer->sectorSize);
-	Buffer->cur_size = 0;
+/*
+ * Load more of block from disk, until at least want bytes of it are
+ * there, or the end of the underlying stream is reached
+ */
+static int fillBlock(Buffer_t *Buffer, Block_t *block, size_t want)
+{
+	ssize_t ret;
+
+	if(block->valid >= want)
+		return 0;
+	ret = readFully(Buffer, block->data + block->valid,
+			block->start + (mt_off_t) block->valid,
+			want - block->valid);
+	if(ret < 0)
+		return -1;
+	block->valid += (size_t) ret;
 	return 0;
 }
 
-#undef OFFSET
-#define OFFSET ((size_t)(start - This->current))
+/*
+ * Number of blocks following block which are not cached yet, up to
+ * the readahead window
+ */
+static size_t readaheadBlocks(Buffer_t *Buffer, Block_t *block)
+{
+	size_t n;
+	mt_off_t pos;
 
-typedef enum position_t {
-	OUTSIDE,
-	APPEND,
-	INSIDE,
-	ERROR
-} position_t;
+	if(block->valid)
+		return 0;
+	for(n = 0; n + 1 < Buffer->raBlocks; n++) {
+		pos = block->start +
+			(mt_off_t) ((n + 1) * Buffer->cylinderSize);
+		if(findBlock(Buffer, pos))
+			break;
+	}
+	if(n && Buffer->raBufSize < (n + 1) * Buffer->cylinderSize) {
+		char *raBuf = realloc(Buffer->raBuf,
+				      (n + 1) * Buffer->cylinderSize);
+		if(!raBuf)
+			return 0;
+		Buffer->raBuf = raBuf;
+		Buffer->raBufSize = (n + 1) * Buffer->cylinderSize;
+	}
+	return n;
+}
 
-static position_t isInBuffer(Buffer_t *This, mt_off_t start, size_t *len)
+/*
+ * Hand the data read ahead into the staging area over to the blocks
+ * following the first one, as long as it lasts
+ */
+static void spreadReadahead(Buffer_t *Buffer, mt_off_t start,
+			    size_t n, size_t size)
 {
-	if(start >= This->current && start < cur_end(This)) {
-		maximize(*len, This->cur_size - OFFSET);
-		return INSIDE;
-	} else if(start == cur_end(This) &&
-		  This->cur_size < This->size &&
-		  *len >= This->sectorSize) {
-		/* append to the buffer for this, three conditions have to
-		 * be met:
-		 *  1. The start falls exactly at the end of the currently
-		 *     loaded data
-		 *  2. There is still space
-		 *  3. We append at least one sector
-		 */
-		maximize(*len, This->size - This->cur_size);
-		*len = ROUND_DOWN(*len, This->sectorSize);
-		return APPEND;
-	} else {
-		if(invalidate_buffer(This, start) < 0)
-			return ERROR;
-		maximize(*len, This->cylinderSize - OFFSET);
-		maximize(*len, pos_to_next_full_cyl(This, This->current));
-		return OUTSIDE;
+	size_t i, offset;
+	Block_t *block;
+
+	for(i = 1; i <= n; i++) {
+		offset = i * Buffer->cylinderSize;
+		if(offset >= size)
+			break;
+		block = allocBlock(Buffer, start + (mt_off_t) offset);
+		if(!block)
+			break;
+		block->valid = size - offset;
+		maximize(block->valid, Buffer->cylinderSize);
+		memcpy(block->data, Buffer->raBuf + offset, block->valid);
+		/* not used yet, let clock pick it first if needed */
+		block->referenced = 0;
+	}
+}
+
+/* Block containing position start, if already in cache, or a new one */
+static Block_t *getBlock(Buffer_t *Buffer, mt_off_t start)
+{
+	Block_t *block;
+
+	start = ROUND_DOWN(start, (mt_off_t) Buffer->cylinderSize);
+	block = findBlock(Buffer, start);
+	if(block) {
+		block->referenced = 1;
+		return block;
 	}
+	return allocBlock(Buffer, start);
+}
+
+/*
+ * Write back any dirty cached data overlapping [start, start+len), so
+ * that it can be read directly from the underlying stream
+ */
+static int flushRange(Buffer_t *Buffer, mt_off_t start, size_t len)
+{
+	mt_off_t pos, end = start + (mt_off_t) len;
+	Block_t *block;
+	size_t i;
+
+	if(len / Buffer->cylinderSize < Buffer->usedBlocks) {
+		for(pos = ROUND_DOWN(start, (mt_off_t) Buffer->cylinderSize);
+		    pos < end;
+		    pos += (mt_off_t) Buffer->cylinderSize) {
+			block = findBlock(Buffer, pos);
+			if(block && writeBlock(Buffer, block) < 0)
+				return -1;
+		}
+		return 0;
+	}
+
+	for(i=0; i < Buffer->usedBlocks; i++) {
+		block = &Buffer->blocks[i];
+		if(block->dirty &&
+		   block->start < end &&
+		   block->start + (mt_off_t) Buffer->cylinderSize > start &&
+		   writeBlock(Buffer, block) < 0)
+			return -1;
+	}
+	return 0;
 }
 
 static ssize_t buf_pread(Stream_t *Stream, char *buf,
 			 mt_off_t start, size_t len)
 {
-	size_t length;
+	Block_t *block;
 	size_t offset;
-	char *disk_ptr;
-	ssize_t ret;
+	size_t ra = 0;
+	ssize_t ret = 0;
 	DeclareThis(Buffer_t);
 
 	if(!len)
 		return 0;
 
 	/*fprintf(stderr, "buf read %x   %x %x\n", Stream, start, len);*/
-	switch(isInBuffer(This, start, &len)) {
-		case OUTSIDE:
-		case APPEND:
-			/* always load until the end of the cylinder */
-			length = pos_to_next_full_cyl(This, cur_end(This));
-			maximize(length, This->size - This->cur_size);
-
-			/* read it! */
-			ret=PREADS(This->head.Next,
-				   This->buf + This->cur_size,
-				   This->current + (mt_off_t) This->cur_size,
-				   length);
-			if ( ret < 0 )
-				return ret;
-			This->cur_size += (size_t) ret;
-			if (This->current+(mt_off_t)This->cur_size < start) {
-				fprintf(stderr, "Short buffer fill\n");
-				exit(1);
-			}
-			break;
-		case INSIDE:
-			/* nothing to do */
-			break;
-		case ERROR:
+	if(start % (mt_off_t) This->sectorSize == 0 &&
+	   len > This->cylinderSize) {
+		/* big aligned read: read directly into caller's buffer,
+		 * without going through the cache */
+		len = ROUND_DOWN(len, This->sectorSize);
+		if(flushRange(This, start, len) < 0)
 			return -1;
+		ret = PREADS(This->head.Next, buf, start, len);
+		if(ret > 0)
+			This->seqEnd = start + (mt_off_t) ret;
+		return ret;
 	}
 
-	offset = OFFSET;
-	disk_ptr = This->buf + offset;
-	maximize(len, This->cur_size - offset);
-	memcpy(buf, disk_ptr, len);
+	block = getBlock(This, start);
+	if(!block)
+		return -1;
+	offset = (size_t) (start - block->start);
+	maximize(len, This->cylinderSize - offset);
+
+	if(offset + len > block->valid) {
+		/* miss: adjust readahead window to access pattern */
+		if(start != This->seqEnd)
+			This->raBlocks = 0;
+		else if(!This->raBlocks)
+			This->raBlocks = 1;
+		else if(This->raBlocks < This->maxRaBlocks)
+			This->raBlocks *= 2;
+		maximize(This->raBlocks, This->maxRaBlocks);
+	}
+
+	if(offset >= block->valid &&
+	   (ra = readaheadBlocks(This, block))) {
+		ret = readFully(This, This->raBuf, block->start,
+					(ra + 1) * This->cylinderSize);
+		if(ret < 0)
+			return -1;
+		block->valid = (size_t) ret;
+		maximize(block->valid, This->cylinderSize);
+		memcpy(block->data, This->raBuf, block->valid);
+	} else if(offset + len > block->valid &&
+		  fillBlock(This, block,
+			    This->raBlocks ? This->cylinderSize :
+			    ROUND_UP(offset + len, This->sectorSize)) < 0)
+		return -1;
+	if(offset >= block->valid)
+		/* end of disk */
+		return 0;
+
+	maximize(len, block->valid - offset);
+	memcpy(buf, block->data + offset, len);
+	This->seqEnd = start + (mt_off_t) len;
+	if(ra)
+		/* only now, as this may evict our block */
+		spreadReadahead(This, block->start, ra, (size_t) ret);
 	return (ssize_t) len;
 }
 
 static ssize_t buf_pwrite(Stream_t *Stream, char *buf,
 			  mt_off_t start, size_t len)
 {
-	char *disk_ptr;
+	Block_t *block;
+	size_t offset;
 	DeclareThis(Buffer_t);
-	size_t offset=0;
 
 	if(!len)
 		return 0;
 
 	This->ever_dirty = 1;
 
+	block = getBlock(This, start);
+	if(!block)
+		return -1;
+	offset = (size_t) (start - block->start);
+	maximize(len, This->cylinderSize - offset);
+
 #ifdef DEBUG
-	fprintf(stderr, "buf write %x   %02x %08x %08x -- %08x %08x -- %08x\n",
-		Stream, (unsigned char) This->buf[0],
-		start, len, This->current, This->cur_size, This->size);
-	fprintf(stderr, "%d %d %d %x %x\n",
-		start == This->current + This->cur_size,
-		This->cur_size < This->size,
-		len >= This->sectorSize, len, This->sectorSize);
-#endif
-	switch(isInBuffer(This, start, &len)) {
-		case OUTSIDE:
-#ifdef DEBUG
-			fprintf(stderr, "outside\n");
+	fprintf(stderr, "buf write %x   %08x %08x -- %08x %08x\n",
+		Stream, start, len, block->start, block->valid);
 #endif
-			if(start % (mt_off_t) This->cylinderSize ||
-			   len < This->sectorSize) {
-				size_t readSize;
-				ssize_t ret;
-				size_t bytes_read;
-
-				readSize = This->cylinderSize -
-					(size_t)(This->current % (mt_off_t) This->cylinderSize);
-
-				ret=PREADS(This->head.Next, This->buf,
-					   (mt_off_t)This->current, readSize);
-				/* read it! */
-				if ( ret < 0 )
-					return ret;
-				bytes_read = (size_t) ret;
-				if(bytes_read % This->sectorSize) {
-				  fprintf(stderr, "Weird: read size ("SSZF") not a multiple of sector size (%d)\n", bytes_read, (int) This->sectorSize);
-				    bytes_read -= bytes_read % This->sectorSize;
-				    if(bytes_read == 0) {
-					fprintf(stderr, "Nothing left\n");
-					exit(1);
-				    }
-				}
-				This->cur_size = bytes_read;
+	if(offset == block->valid && len >= This->sectorSize) {
+		/* append whole sectors to the loaded data: no need to
+		 * read what we are going to overwrite anyways */
+		len = ROUND_DOWN(len, This->sectorSize);
+		block->valid += len;
+		if(This->head.Next->Class->pre_allocate)
+			PRE_ALLOCATE(This->head.Next,
+				     block->start + (mt_off_t) block->valid);
+	} else {
+		if(offset > block->valid || len < This->sectorSize) {
+			if(fillBlock(This, block, This->cylinderSize) < 0)
+				return -1;
+			if(offset >= block->valid) {
 				/* for dosemu. Autoextend size */
-				if(!This->cur_size) {
-					memset(This->buf,0,readSize);
-					This->cur_size = readSize;
-				}
-				offset = OFFSET;
-				break;
+				memset(block->data + block->valid, 0,
+				       This->cylinderSize - block->valid);
+				block->valid = This->cylinderSize;
 			}
-			/* FALL THROUGH */
-		case APPEND:
-#ifdef DEBUG
-			fprintf(stderr, "append\n");
-#endif
-			len = ROUND_DOWN(len, This->sectorSize);
-			offset = OFFSET;
-			maximize(len, This->size - offset);
-			This->cur_size += len;
-			if(This->head.Next->Class->pre_allocate)
-				PRE_ALLOCATE(This->head.Next, cur_end(This));
-			break;
-		case INSIDE:
-			/* nothing to do */
-#ifdef DEBUG
-			fprintf(stderr, "inside\n");
-#endif
-			offset = OFFSET;
-			maximize(len, This->cur_size - offset);
-			break;
-		case ERROR:
-			return -1;
-#ifdef DEBUG
-		default:
-			fprintf(stderr, "Should not happen\n");
-			exit(1);
-#endif
-	}
-
-	disk_ptr = This->buf + offset;
-
-	/* extend if we write beyond end */
-	if(offset + len > This->cur_size) {
-		len -= (offset + len) % This->sectorSize;
-		This->cur_size = len + offset;
+		}
+		if(offset + len > block->valid) {
+			/* extend if we write beyond end */
+			len -= (offset + len) % This->sectorSize;
+			block->valid = offset + len;
+		}
 	}
 
-	memcpy(disk_ptr, buf, len);
-	if(!This->dirty || offset < This->dirty_pos)
-		This->dirty_pos = ROUND_DOWN(offset, This->sectorSize);
-	if(!This->dirty || offset + len > This->dirty_end)
-		This->dirty_end = ROUND_UP(offset + len, This->sectorSize);
+	memcpy(block->data + offset, buf, len);
+	if(!block->dirty || offset < block->dirty_pos)
+		block->dirty_pos = ROUND_DOWN(offset, This->sectorSize);
+	if(!block->dirty || offset + len > block->dirty_end)
+		block->dirty_end = ROUND_UP(offset + len, This->sectorSize);
 
-	if(This->dirty_end > This->cur_size) {
+	if(block->dirty_end > block->valid) {
 		fprintf(stderr,
-			"Internal error, dirty end too big dirty_end=%x cur_size=%x len=%x offset=%d sectorSize=%x\n",
-			(unsigned int) This->dirty_end,
-			(unsigned int) This->cur_size,
+			"Internal error, dirty end too big dirty_end=%x valid=%x len=%x offset=%d sectorSize=%x\n",
+			(unsigned int) block->dirty_end,
+			(unsigned int) block->valid,
 			(unsigned int) len,
 			(int) offset, (int) This->sectorSize);
-		fprintf(stderr, "offset + len + grain - 1 = %x\n",
-				(int) (offset + len + This->sectorSize - 1));
-		fprintf(stderr, "ROUNDOWN(offset + len + grain - 1) = %x\n",
-				(int)ROUND_DOWN(offset + len + This->sectorSize - 1,
-								This->sectorSize));
-		fprintf(stderr, "This->dirty = %d\n", This->dirty);
 		exit(1);
 	}
 
-	This->dirty = 1;
+	block->dirty = 1;
 	return (ssize_t) len;
 }
 
+static int cmpBlockStart(const void *a, const void *b)
+{
+	mt_off_t sa = (*(Block_t * const *) a)->start;
+	mt_off_t sb = (*(Block_t * const *) b)->start;
+
+	if(sa < sb)
+		return -1;
+	return sa > sb;
+}
+
+/* Write back all dirty blocks, in disk order */
+static int _buf_flush(Buffer_t *This)
+{
+	Block_t **dirty;
+	size_t i, n;
+	int ret = 0;
+
+	dirty = NewArray(This->usedBlocks, Block_t *);
+	if(!dirty) {
+		/* no sorting, then */
+		for(i=0; i < This->usedBlocks; i++)
+			if(writeBlock(This, &This->blocks[i]) < 0)
+				return -1;
+		return 0;
+	}
+
+	for(i=0, n=0; i < This->usedBlocks; i++)
+		if(This->blocks[i].dirty)
+			dirty[n++] = &This->blocks[i];
+	qsort(dirty, n, sizeof(*dirty), cmpBlockStart);
+	for(i=0; i < n; i++)
+		if(writeBlock(This, dirty[i]) < 0) {
+			ret = -1;
+			break;
+		}
+	free(dirty);
+	return ret;
+}
+
 static int buf_flush(Stream_t *Stream)
 {
 	int ret;
@@ -329,14 +528,32 @@ static int buf_flush(Stream_t *Stream)
 	return ret;
 }
 
+static int buf_get_raw_fd(Stream_t *Stream, mt_off_t *offset)
+{
+	/* dirty blocks must reach the disk before it is read directly */
+	if(buf_flush(Stream) < 0)
+		return -1;
+	return get_raw_fd_pass_through(Stream, offset);
+}
+
 
 static int buf_free(Stream_t *Stream)
 {
 	DeclareThis(Buffer_t);
-
-	if(This->buf)
-		free(This->buf);
-	This->buf = 0;
+	size_t i;
+
+	for(i=0; i < This->usedBlocks; i++)
+		free(This->blocks[i].data);
+	if(This->raBuf)
+		free(This->raBuf);
+	This->raBuf = 0;
+	if(This->blocks)
+		free(This->blocks);
+	if(This->hash)
+		free(This->hash);
+	This->blocks = 0;
+	This->hash = 0;
+	This->usedBlocks = 0;
 	return 0;
 }
 
@@ -352,13 +569,32 @@ static Class_t BufferClass = {
 	0, /* pre-allocate */
 	get_dosConvert_pass_through, /* dos convert */
 	0, /* discard */
+	buf_get_raw_fd, /* get_raw_fd */
 };
 
+/*
+ * Size of a disk cache holding at least size bytes, grown to
+ * MTOOLS_BUFFER_CACHE_SIZE if that asks for more.  Only meant for the
+ * buffer of the disk itself, not for the ones of directories
+ */
+size_t buf_cache_size(size_t size, size_t cylinderSize)
+{
+	if(size < (size_t) mtools_buffer_cache_size * 1024)
+		size = ROUND_UP((size_t) mtools_buffer_cache_size * 1024,
+				cylinderSize);
+	return size;
+}
+
+/*
+ * Size is the amount of data to keep cached.  Blocks are only
+ * allocated once they are used
+ */
 Stream_t *buf_init(Stream_t *Next, size_t size,
 		   size_t cylinderSize,
 		   size_t sectorSize)
 {
 	Buffer_t *Buffer;
+	size_t i;
 
 #ifdef HAVE_ASSERT_H
 	assert(size != 0);
@@ -380,22 +616,38 @@ Stream_t *buf_init(Stream_t *Next, size_t size,
 	if(!Buffer)
 		return 0;
 	init_head(&Buffer->head, &BufferClass, Next);
-	Buffer->buf = malloc(size);
-	if ( !Buffer->buf){
+	Buffer->nrBlocks = size / cylinderSize;
+	for(Buffer->hashSize = 1;
+	    Buffer->hashSize < 2 * Buffer->nrBlocks;
+	    Buffer->hashSize <<= 1);
+	Buffer->blocks = NewArray(Buffer->nrBlocks, Block_t);
+	Buffer->hash = NewArray(Buffer->hashSize, size_t);
+	if (!Buffer->blocks || !Buffer->hash) {
+		if(Buffer->blocks)
+			free(Buffer->blocks);
+		if(Buffer->hash)
+			free(Buffer->hash);
 		Free(Buffer);
 		return 0;
 	}
-	Buffer->size = size;
-	Buffer->dirty = 0;
+	for(i=0; i < Buffer->hashSize; i++)
+		Buffer->hash[i] = NO_BLOCK;
+	Buffer->usedBlocks = 0;
+	Buffer->hand = 0;
+
+	/* readahead may use up to half of the cache */
+	Buffer->maxRaBlocks = Buffer->nrBlocks / 2;
+	maximize(Buffer->maxRaBlocks, MAX_READAHEAD / cylinderSize);
+	if(!Buffer->maxRaBlocks)
+		Buffer->maxRaBlocks = 1;
+	Buffer->raBlocks = 0;
+	Buffer->seqEnd = 0;
+	Buffer->raBuf = 0;
+	Buffer->raBufSize = 0;
 	Buffer->cylinderSize = cylinderSize;
 	Buffer->sectorSize = sectorSize;
 
 	Buffer->ever_dirty = 0;
-	Buffer->dirty_pos = 0;
-	Buffer->dirty_end = 0;
-	Buffer->current = 0L;
-	Buffer->cur_size = 0; /* buffer currently empty */
 
 	return &Buffer->head;
 }
-
@@ -20,6 +20,7 @@
 
 #include "stream.h"
 
+size_t buf_cache_size(size_t size, size_t cylinderSize);
 Stream_t *buf_init(Stream_t *Next,
 		   size_t size,
 		   size_t cylinderSize,
@@ -65,6 +65,15 @@ unsigned int mtools_dotted_dir=0;
 unsigned int mtools_twenty_four_hour_clock=1;
 unsigned int mtools_lock_timeout=30;
 unsigned int mtools_default_codepage=850;
+unsigned int mtools_fat_bulk_load=0;
+unsigned int mtools_lazy_fat_mirror=0;
+unsigned int mtools_prefetch_chain=0;
+unsigned int mtools_buffer_cache_size=256;
+unsigned int mtools_no_mmap=0;
+unsigned int mtools_io_uring=0;
+unsigned int mtools_copy_buffers=0;
+unsigned int mtools_copy_buffer_size=512;
+unsigned int mtools_sparse_image=0;
 const char *mtools_date_string="yyyy-mm-dd";
 
 typedef struct switches_l {
@@ -95,6 +104,17 @@ static switches_t global_switches[] = {
     { "MTOOLS_DATE_STRING",
       (caddr_t) &mtools_date_string, T_STRING },
     { "MTOOLS_LOCK_TIMEOUT", (caddr_t) &mtools_lock_timeout, T_UINT },
+    { "MTOOLS_FAT_BULK_LOAD", (caddr_t) &mtools_fat_bulk_load, T_UINT },
+    { "MTOOLS_LAZY_FAT_MIRROR", (caddr_t) &mtools_lazy_fat_mirror, T_UINT },
+    { "MTOOLS_PREFETCH_CHAIN", (caddr_t) &mtools_prefetch_chain, T_UINT },
+    { "MTOOLS_BUFFER_CACHE_SIZE",
+      (caddr_t) &mtools_buffer_cache_size, T_UINT },
+    { "MTOOLS_NO_MMAP", (caddr_t) &mtools_no_mmap, T_UINT },
+    { "MTOOLS_IO_URING", (caddr_t) &mtools_io_uring, T_UINT },
+    { "MTOOLS_COPY_BUFFERS", (caddr_t) &mtools_copy_buffers, T_UINT },
+    { "MTOOLS_COPY_BUFFER_SIZE",
+      (caddr_t) &mtools_copy_buffer_size, T_UINT },
+    { "MTOOLS_SPARSE_IMAGE", (caddr_t) &mtools_sparse_image, T_UINT },
     { "DEFAULT_CODEPAGE", (caddr_t) &mtools_default_codepage, T_UINT }
 };
 
@@ -17,15 +17,325 @@
 #include "sysincludes.h"
 #include "mtools.h"
 #include "file.h"
+#include "plain_io.h"
 #include "llong.h"
 
+/*
+ * Size of the chunks in which data is copied: MTOOLS_COPY_BUFFER_SIZE,
+ * rounded up to whole clusters of the DOS side, so that each write
+ * allocates and maps whole clusters at once
+ */
+static size_t copyChunkSize(Stream_t *Source, Stream_t *Target)
+{
+	size_t size = (size_t) mtools_copy_buffer_size * 1024;
+	size_t clus = getFileClusterBytes(Target);
+
+	if(!clus)
+		clus = getFileClusterBytes(Source);
+	if(!size)
+		size = 8*16384;
+	if(clus)
+		size = ROUND_UP(size, clus);
+	return size;
+}
+
+/* Page aligned, so that it may also be used for O_DIRECT I/O */
+static char *allocCopyBuffer(size_t size)
+{
+#ifdef HAVE_POSIX_MEMALIGN
+	void *buf;
+	long pageSize = 4096;
+
+#ifdef _SC_PAGESIZE
+	pageSize = sysconf(_SC_PAGESIZE);
+	if(pageSize <= 0)
+		pageSize = 4096;
+#endif
+	if(posix_memalign(&buf, (size_t) pageSize, size))
+		return NULL;
+	return (char *) buf;
+#else
+	return malloc(size);
+#endif
+}
+
+/*
+ * Read up to size bytes from Source.  If Source is a host file with
+ * holes, a hole at the current position is skipped first, and its
+ * length returned in *hole.  *dataLeft tracks the data remaining
+ * before the next hole: 0 to look again, -1 if holes can't be detected
+ */
+static ssize_t readChunk(Stream_t *Source, char *buf, size_t size,
+			 mt_off_t *dataLeft, mt_off_t *hole)
+{
+	ssize_t ret;
+
+	*hole = 0;
+	if(*dataLeft == 0) {
+		*hole = skip_hole(Source, dataLeft);
+		if(*hole < 0) {
+			*hole = 0;
+			*dataLeft = -1;
+		}
+	}
+	if(*dataLeft > 0 && (mt_off_t) size > *dataLeft)
+		size = (size_t) *dataLeft;
+	ret = READS(Source, buf, size);
+	if(ret > 0 && *dataLeft > 0)
+		*dataLeft -= ret;
+	return ret;
+}
+
+/* Write the zeroes of a hole skipped by readChunk, out of zeroBuf */
+static int writeHole(Stream_t *Target, char *zeroBuf, size_t size,
+		     mt_off_t hole)
+{
+	size_t len;
+	ssize_t ret;
+
+	while(hole > 0) {
+		len = hole < (mt_off_t) size ? (size_t) hole : size;
+		ret = force_write(Target, zeroBuf, len);
+		if(ret != (ssize_t) len) {
+			if(ret < 0)
+				perror("write in copy");
+			else
+				fprintf(stderr,
+					"Short write "SSZF" instead of "SSZF"\n",
+					ret, len);
+			if(errno == ENOSPC)
+				got_signal = 1;
+			return -1;
+		}
+		hole -= (mt_off_t) len;
+	}
+	return 0;
+}
+
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+
+/*
+ * Pipelined copy: a reader thread fills a ring of buffers from the
+ * source, while the calling thread writes them to the target.  Only
+ * used when source and target share no stream, as streams are not
+ * thread safe.  Signals are blocked in the reader, so that got_signal
+ * is only set and read by the calling thread, which tells the reader
+ * to stop through ring->stop.
+ */
+
+typedef struct CopyBuf_t {
+	char *data;
+	ssize_t len;	/* 0 at end of file, -1 on read error */
+	int err;	/* errno of read error */
+	mt_off_t hole;	/* zeroes to write before data */
+} CopyBuf_t;
+
+typedef struct CopyRing_t {
+	Stream_t *Source;
+	CopyBuf_t *bufs;
+	unsigned int nrBufs;
+	size_t bufSize;
+	mt_off_t dataLeft;	/* for readChunk, used by reader only */
+
+	pthread_mutex_t lock;
+	pthread_cond_t filled;	/* signaled by reader */
+	pthread_cond_t drained;	/* signaled by writer */
+	unsigned int head;	/* next buffer to be written */
+	unsigned int count;	/* number of buffers ready to write */
+	int stop;		/* writer gave up */
+	int done;		/* reader is finished */
+} CopyRing_t;
+
+static void *copyReader(void *arg)
+{
+	CopyRing_t *ring = (CopyRing_t *) arg;
+	unsigned int tail = 0;
+	CopyBuf_t *buf;
+	int stop;
+
+	while(1) {
+		pthread_mutex_lock(&ring->lock);
+		while(ring->count == ring->nrBufs && !ring->stop)
+			pthread_cond_wait(&ring->drained, &ring->lock);
+		stop = ring->stop;
+		pthread_mutex_unlock(&ring->lock);
+		if(stop)
+			break;
+
+		/* this buffer is ours until we hand it over */
+		buf = &ring->bufs[tail];
+		buf->len = readChunk(ring->Source, buf->data, ring->bufSize,
+				     &ring->dataLeft, &buf->hole);
+		buf->err = errno;
+
+		pthread_mutex_lock(&ring->lock);
+		ring->count++;
+		pthread_cond_signal(&ring->filled);
+		pthread_mutex_unlock(&ring->lock);
+		if(buf->len <= 0)
+			break;
+		tail = (tail + 1) % ring->nrBufs;
+	}
+
+	pthread_mutex_lock(&ring->lock);
+	ring->done = 1;
+	pthread_cond_signal(&ring->filled);
+	pthread_mutex_unlock(&ring->lock);
+	return NULL;
+}
+
+/* Does Stream, or any stream below it, also appear below Other? */
+static int sharesStream(Stream_t *Stream, Stream_t *Other)
+{
+	Stream_t *s;
+
+	for(; Stream; Stream = Stream->Next)
+		for(s = Other; s; s = s->Next)
+			if(s == Stream)
+				return 1;
+	return 0;
+}
+
+/* Returns -2 if pipelining was not possible */
+static mt_off_t pipelinedCopy(Stream_t *Source, Stream_t *Target,
+			      size_t bufSize)
+{
+	CopyRing_t ring;
+	pthread_t reader;
+	sigset_t allSignals, oldMask;
+	int err;
+	CopyBuf_t *buf;
+	char *zeroBuf = NULL;
+	mt_off_t pos = 0;
+	ssize_t ret, retw;
+	unsigned int i;
+
+	ring.Source = Source;
+	ring.nrBufs = mtools_copy_buffers;
+	ring.bufSize = bufSize;
+	ring.dataLeft = 0;
+	ring.head = 0;
+	ring.count = 0;
+	ring.stop = 0;
+	ring.done = 0;
+	ring.bufs = NewArray(ring.nrBufs, CopyBuf_t);
+	if(!ring.bufs)
+		return -2;
+	for(i=0; i < ring.nrBufs; i++) {
+		ring.bufs[i].data = allocCopyBuffer(ring.bufSize);
+		if(!ring.bufs[i].data)
+			break;
+	}
+	err = i < ring.nrBufs ||
+		pthread_mutex_init(&ring.lock, NULL) ||
+		pthread_cond_init(&ring.filled, NULL) ||
+		pthread_cond_init(&ring.drained, NULL);
+	if(!err) {
+		/* the reader inherits the mask */
+		sigfillset(&allSignals);
+		pthread_sigmask(SIG_BLOCK, &allSignals, &oldMask);
+		err = pthread_create(&reader, NULL, copyReader, &ring);
+		pthread_sigmask(SIG_SETMASK, &oldMask, NULL);
+	}
+	if(err) {
+		while(i--)
+			free(ring.bufs[i].data);
+		free(ring.bufs);
+		return -2;
+	}
+
+	while(1) {
+		pthread_mutex_lock(&ring.lock);
+		while(!ring.count && !ring.done)
+			pthread_cond_wait(&ring.filled, &ring.lock);
+		i = ring.count;
+		pthread_mutex_unlock(&ring.lock);
+		if(!i) {
+			/* reader finished without handing over the end */
+			pos = -1;
+			break;
+		}
+
+		buf = &ring.bufs[ring.head];
+		ret = buf->len;
+		if (ret < 0 ){
+			errno = buf->err;
+			perror("file read");
+			pos = -1;
+			break;
+		}
+		if(buf->hole) {
+			if(!zeroBuf)
+				zeroBuf = calloc(ring.bufSize, 1);
+			if(!zeroBuf) {
+				printOom();
+				pos = -1;
+				break;
+			}
+			if(writeHole(Target, zeroBuf, ring.bufSize,
+				     buf->hole) < 0) {
+				pos = -1;
+				break;
+			}
+			pos += buf->hole;
+		}
+		if(!ret)
+			break;
+		if(got_signal) {
+			pos = -1;
+			break;
+		}
+		if ((retw = force_write(Target, buf->data, (size_t) ret)) != ret){
+			if(retw < 0 )
+				perror("write in copy");
+			else
+				fprintf(stderr,
+					"Short write "SSZF" instead of "SSZF"\n",
+					retw, ret);
+			if(errno == ENOSPC)
+				got_signal = 1;
+			pos = ret;
+			break;
+		}
+		pos += ret;
+
+		pthread_mutex_lock(&ring.lock);
+		ring.head = (ring.head + 1) % ring.nrBufs;
+		ring.count--;
+		pthread_cond_signal(&ring.drained);
+		pthread_mutex_unlock(&ring.lock);
+	}
+
+	pthread_mutex_lock(&ring.lock);
+	ring.stop = 1;
+	pthread_cond_signal(&ring.drained);
+	pthread_mutex_unlock(&ring.lock);
+	pthread_join(reader, NULL);
+
+	pthread_cond_destroy(&ring.drained);
+	pthread_cond_destroy(&ring.filled);
+	pthread_mutex_destroy(&ring.lock);
+	for(i=0; i < ring.nrBufs; i++)
+		free(ring.bufs[i].data);
+	free(ring.bufs);
+	if(zeroBuf)
+		free(zeroBuf);
+	return pos;
+}
+#endif
+
 /*
  * Copy the data from source to target
  */
 
 mt_off_t copyfile(Stream_t *Source, Stream_t *Target)
 {
-	char buffer[8*16384];
+	char *buffer;
+	char *zeroBuf = NULL;
+	size_t size;
+	mt_off_t dataLeft = 0;
+	mt_off_t hole;
 	mt_off_t pos;
 	ssize_t ret;
 	ssize_t retw;
@@ -40,17 +350,70 @@ mt_off_t copyfile(Stream_t *Source, Stream_t *Target)
 		return -1;
 	}
 
+	size = copyChunkSize(Source, Target);
+
+	/* Contiguous runs of a DOS file going to a plain file are copied
+	 * by the kernel.  Falls back to the loops below as soon as this
+	 * is no longer possible */
 	pos = 0;
+	while(1) {
+		ret = copyFileDirect(Source, Target, size);
+		if(ret == -2)
+			break;
+		if(ret < 0) {
+			perror("copy");
+			if(errno == ENOSPC)
+				got_signal = 1;
+			return -1;
+		}
+		if(!ret)
+			return pos;
+		pos += ret;
+		if(got_signal)
+			return -1;
+	}
+
+#ifdef HAVE_PTHREAD
+	if(mtools_copy_buffers >= 2 && !sharesStream(Source, Target)) {
+		mt_off_t piped = pipelinedCopy(Source, Target, size);
+		if(piped != -2)
+			return piped < 0 ? piped : pos + piped;
+	}
+#endif
+
+	buffer = allocCopyBuffer(size);
+	if(!buffer) {
+		printOom();
+		return -1;
+	}
+
 	while(1){
-		ret = READS(Source, buffer, 8*16384);
+		ret = readChunk(Source, buffer, size, &dataLeft, &hole);
 		if (ret < 0 ){
 			perror("file read");
-			return -1;
+			pos = -1;
+			break;
+		}
+		if(hole) {
+			if(!zeroBuf)
+				zeroBuf = calloc(size, 1);
+			if(!zeroBuf) {
+				printOom();
+				pos = -1;
+				break;
+			}
+			if(writeHole(Target, zeroBuf, size, hole) < 0) {
+				pos = -1;
+				break;
+			}
+			pos += hole;
 		}
 		if(!ret)
 			break;
-		if(got_signal)
-			return -1;
+		if(got_signal) {
+			pos = -1;
+			break;
+		}
 		if (ret == 0)
 			break;
 		if ((retw = force_write(Target, buffer, (size_t) ret)) != ret){
@@ -62,9 +425,13 @@ mt_off_t copyfile(Stream_t *Source, Stream_t *Target)
 					retw, ret);
 			if(errno == ENOSPC)
 				got_signal = 1;
-			return ret;
+			pos = ret;
+			break;
 		}
 		pos += ret;
 	}
+	free(buffer);
+	if(zeroBuf)
+		free(zeroBuf);
 	return pos;
 }
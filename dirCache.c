@@ -22,6 +22,18 @@
 
 #define BITS_PER_INT (sizeof(unsigned int) * 8)
 
+typedef struct dirCacheChunk_t {
+	struct dirCacheChunk_t *next;
+	size_t size; /* including this header */
+	size_t used;
+} dirCacheChunk_t;
+
+/* alignment of everything allocated from chunks */
+#define DC_ALIGN 16
+#define DC_CHUNK_HEADER ROUND_UP(sizeof(dirCacheChunk_t), DC_ALIGN)
+#define DC_MIN_CHUNK 4096
+#define DC_MAX_CHUNK 262144
+
 
 static inline uint32_t rol(uint32_t arg, int shift)
 {
@@ -30,7 +42,7 @@ static inline uint32_t rol(uint32_t arg, int shift)
 }
 
 
-static uint32_t calcHash(wchar_t *name)
+static uint32_t calcHash(const wchar_t *name)
 {
 	uint32_t hash;
 	unsigned int i;
@@ -59,14 +71,97 @@ static uint32_t calcHash(wchar_t *name)
 	return hash;
 }
 
-static unsigned int addBit(unsigned int *bitmap,
+/* Of the entries from lo to hi, the first one ending after slot, or hi */
+static unsigned int searchSorted(dirCache_t *cache,
+				 unsigned int lo, unsigned int hi,
+				 unsigned int slot)
+{
+	unsigned int mid;
+
+	while(lo < hi) {
+		mid = lo + (hi - lo) / 2;
+		if(cache->sorted[mid]->endSlot > slot)
+			hi = mid;
+		else
+			lo = mid + 1;
+	}
+	return lo;
+}
+
+/* Position in sorted of the entry holding slot, or else of the first
+ * entry after it */
+static unsigned int findSorted(dirCache_t *cache, unsigned int slot)
+{
+	dirCacheEntry_t **sorted = cache->sorted;
+	unsigned int n = cache->nrSorted;
+	unsigned int group = slot / DC_GROUP_SLOTS;
+	unsigned int start = group * DC_GROUP_SLOTS;
+	unsigned int hint;
+
+	if(group >= cache->nrGroups)
+		return searchSorted(cache, 0, n, slot);
+
+	hint = cache->groupHints[group];
+	if(hint > n ||
+	   (hint > 0 && sorted[hint-1]->endSlot > start) ||
+	   (hint < n && sorted[hint]->endSlot <= start)) {
+		hint = searchSorted(cache, 0, n, start);
+		cache->groupHints[group] = hint;
+	}
+	/* every entry holds at least one slot, so the group spans at
+	 * most DC_GROUP_SLOTS of them */
+	if(n - hint > DC_GROUP_SLOTS)
+		n = hint + DC_GROUP_SLOTS;
+	return searchSorted(cache, hint, n, slot);
+}
+
+static dirCacheEntry_t *findEntry(dirCache_t *cache, unsigned int slot)
+{
+	unsigned int i = findSorted(cache, slot);
+
+	if(i < cache->nrSorted && cache->sorted[i]->beginSlot <= slot)
+		return cache->sorted[i];
+	return 0;
+}
+
+static int insertSorted(dirCache_t *cache, unsigned int i,
+			dirCacheEntry_t *dce)
+{
+	dirCacheEntry_t **sorted;
+	unsigned int n;
+
+	if(cache->nrSorted == cache->sortedAllocated) {
+		n = cache->sortedAllocated ? cache->sortedAllocated * 2 : 64;
+		sorted = realloc(cache->sorted, n * sizeof(dirCacheEntry_t *));
+		if(!sorted)
+			return -1;
+		cache->sorted = sorted;
+		cache->sortedAllocated = n;
+	}
+	memmove(cache->sorted + i + 1, cache->sorted + i,
+		(cache->nrSorted - i) * sizeof(dirCacheEntry_t *));
+	cache->sorted[i] = dce;
+	cache->nrSorted++;
+	return 0;
+}
+
+static void removeSorted(dirCache_t *cache, unsigned int i, unsigned int n)
+{
+	if(!n)
+		return;
+	memmove(cache->sorted + i, cache->sorted + i + n,
+		(cache->nrSorted - i - n) * sizeof(dirCacheEntry_t *));
+	cache->nrSorted -= n;
+}
+
+static unsigned int addBit(unsigned int *bitmap, unsigned int size,
 			   unsigned int hash, int checkOnly)
 {
 	unsigned int bit;
-	int entry;
+	unsigned int entry;
 
 	bit = 1u << (hash % BITS_PER_INT);
-	entry = (hash / BITS_PER_INT) % DC_BITMAP_SIZE;
+	entry = (hash / BITS_PER_INT) % size;
 
 	if(checkOnly)
 		return bitmap[entry] & bit;
@@ -76,28 +171,309 @@ static unsigned int addBit(unsigned int *bitmap,
 	}
 }
 
+/* Spread all bits of a name hash over the whole word.  Large bitmaps
+ * index with many bits, which must be independent for each bitmap */
+static uint32_t mixHash(uint32_t hash)
+{
+	hash ^= hash >> 16;
+	hash *= 0x85ebca6b;
+	hash ^= hash >> 13;
+	hash *= 0xc2b2ae35;
+	hash ^= hash >> 16;
+	return hash;
+}
+
 static int _addHash(dirCache_t *cache, unsigned int hash, int checkOnly)
 {
+	uint32_t h1 = mixHash(hash);
+	uint32_t h2 = mixHash(hash ^ 0x9e3779b9) | 1;
+
 	return
-		addBit(cache->bm0, hash, checkOnly) &&
-		addBit(cache->bm1, rol(hash,12), checkOnly) &&
-		addBit(cache->bm2, rol(hash,24), checkOnly);
+		addBit(cache->bm0, cache->bmSize, h1, checkOnly) &&
+		addBit(cache->bm1, cache->bmSize, h1 + h2, checkOnly) &&
+		addBit(cache->bm2, cache->bmSize, h1 + 2 * h2, checkOnly);
 }
 
 
 static void addNameToHash(dirCache_t *cache, wchar_t *name)
 {
 	_addHash(cache, calcHash(name), 0);
+	cache->nrNamesHashed++;
+}
+
+static void addDceToHash(dirCache_t *cache, dirCacheEntry_t *dce)
+{
+	if(dce->longName)
+		addNameToHash(cache, dce->longName);
+	addNameToHash(cache, dce->shortName);
+}
+
+static int allocFilter(dirCache_t *cache, unsigned int size)
+{
+	unsigned int *bm;
+
+	bm = NewArray(3 * size, unsigned int);
+	if(!bm)
+		return -1;
+	if(cache->bm0)
+		free(cache->bm0);
+	cache->bm0 = bm;
+	cache->bm1 = bm + size;
+	cache->bm2 = bm + 2 * size;
+	cache->bmSize = size;
+	cache->nrNamesHashed = 0;
+	return 0;
+}
+
+/* Rebuild the filter at twice the size, from the hashed entries.  This
+ * also drops the names of entries which have been deleted since */
+static void growFilter(dirCache_t *cache)
+{
+	dirCacheEntry_t *dce;
+	unsigned int i;
+
+	if(allocFilter(cache, cache->bmSize * 2) < 0)
+		/* keep the old one, only at a higher false positive rate */
+		return;
+	for(i=0; i < cache->nrSorted; i++) {
+		dce = cache->sorted[i];
+		if(dce->beginSlot >= cache->nrHashed)
+			break;
+		if(dce->type == DCET_USED)
+			addDceToHash(cache, dce);
+	}
 }
 
 static void hashDce(dirCache_t *cache, dirCacheEntry_t *dce)
 {
 	if(dce->beginSlot != cache->nrHashed)
 		return;
+	if((cache->nrNamesHashed + 2) * DC_BITS_PER_NAME >
+	   cache->bmSize * BITS_PER_INT)
+		growFilter(cache);
 	cache->nrHashed = dce->endSlot;
-	if(dce->longName)
-		addNameToHash(cache, dce->longName);
-	addNameToHash(cache, dce->shortName);
+	addDceToHash(cache, dce);
+}
+
+static void *chunkAlloc(dirCache_t *cache, size_t size)
+{
+	dirCacheChunk_t *chunk = cache->chunks;
+	size_t chunkSize;
+	void *ret;
+
+	size = ROUND_UP(size, DC_ALIGN);
+	if(!chunk || chunk->used + size > chunk->size) {
+		/* the rest of the current chunk is wasted */
+		chunkSize = chunk ? chunk->size * 2 : DC_MIN_CHUNK;
+		if(chunkSize > DC_MAX_CHUNK)
+			chunkSize = DC_MAX_CHUNK;
+		if(chunkSize < DC_CHUNK_HEADER + size)
+			chunkSize = DC_CHUNK_HEADER + size;
+		chunk = malloc(chunkSize);
+		if(!chunk)
+			return 0;
+		chunk->next = cache->chunks;
+		chunk->size = chunkSize;
+		chunk->used = DC_CHUNK_HEADER;
+		cache->chunks = chunk;
+	}
+	ret = (char *) chunk + chunk->used;
+	chunk->used += size;
+	return ret;
+}
+
+static wchar_t *chunkWcsdup(dirCache_t *cache, const wchar_t *name)
+{
+	size_t size = (wcslen(name) + 1) * sizeof(wchar_t);
+	wchar_t *ret;
+
+	ret = chunkAlloc(cache, size);
+	if(ret)
+		memcpy(ret, name, size);
+	return ret;
+}
+
+static dirCacheEntry_t *newDce(dirCache_t *cache)
+{
+	dirCacheEntry_t *dce;
+
+	dce = cache->freeEntries;
+	if(dce)
+		cache->freeEntries = dce->nextLong;
+	else {
+		dce = chunkAlloc(cache, sizeof(dirCacheEntry_t));
+		if(!dce)
+			return 0;
+	}
+	memset(dce, 0, sizeof(dirCacheEntry_t));
+	return dce;
+}
+
+/* Names stay allocated until the cache is freed */
+static void freeDce(dirCache_t *cache, dirCacheEntry_t *dce)
+{
+	dce->nextLong = cache->freeEntries;
+	cache->freeEntries = dce;
+}
+
+/* Same case folding as match() */
+static int nameEq(const wchar_t *a, const wchar_t *b)
+{
+	while(*a && towupper((wint_t)*a) == towupper((wint_t)*b)) {
+		a++;
+		b++;
+	}
+	return !*a && !*b;
+}
+
+static void linkDce(dirCache_t *cache, dirCacheEntry_t *dce)
+{
+	unsigned int mask = cache->indexSize - 1;
+	dirCacheEntry_t **bucket;
+
+	if(dce->longName && *dce->longName) {
+		bucket = &cache->longIndex[dce->longHash & mask];
+		dce->nextLong = *bucket;
+		*bucket = dce;
+	}
+	bucket = &cache->shortIndex[dce->shortHash & mask];
+	dce->nextShort = *bucket;
+	*bucket = dce;
+}
+
+static void dropIndex(dirCache_t *cache)
+{
+	if(cache->longIndex)
+		free(cache->longIndex);
+	if(cache->shortIndex)
+		free(cache->shortIndex);
+	cache->longIndex = cache->shortIndex = 0;
+	cache->indexSize = 0;
+}
+
+/* Double the number of buckets, once there are as many names as
+ * buckets */
+static int growIndex(dirCache_t *cache)
+{
+	dirCacheEntry_t **oldShort = cache->shortIndex;
+	dirCacheEntry_t *dce, *next;
+	unsigned int oldSize = cache->indexSize;
+	unsigned int i;
+
+	cache->indexSize = oldSize ? oldSize * 2 : 64;
+	cache->shortIndex = NewArray(cache->indexSize, dirCacheEntry_t *);
+	if(cache->longIndex)
+		free(cache->longIndex);
+	cache->longIndex = NewArray(cache->indexSize, dirCacheEntry_t *);
+	if(!cache->shortIndex || !cache->longIndex) {
+		if(oldShort)
+			free(oldShort);
+		dropIndex(cache);
+		return -1;
+	}
+
+	/* every indexed entry is in exactly one short name chain */
+	for(i=0; i < oldSize; i++)
+		for(dce = oldShort[i]; dce; dce = next) {
+			next = dce->nextShort;
+			linkDce(cache, dce);
+		}
+	if(oldShort)
+		free(oldShort);
+	return 0;
+}
+
+static void indexDce(dirCache_t *cache, dirCacheEntry_t *dce)
+{
+	if(cache->indexFailed)
+		return;
+	if(!dce->shortName ||
+	   (cache->nrIndexed >= cache->indexSize && growIndex(cache) < 0)) {
+		cache->indexFailed = 1;
+		return;
+	}
+	if(dce->longName && *dce->longName)
+		dce->longHash = calcHash(dce->longName);
+	dce->shortHash = calcHash(dce->shortName);
+	linkDce(cache, dce);
+	dce->indexed = 1;
+	cache->nrIndexed++;
+}
+
+static void unlinkChain(dirCacheEntry_t **bucket, dirCacheEntry_t *dce,
+			int isLong)
+{
+	while(*bucket && *bucket != dce)
+		bucket = isLong ? &(*bucket)->nextLong : &(*bucket)->nextShort;
+	if(*bucket)
+		*bucket = isLong ? dce->nextLong : dce->nextShort;
+}
+
+static void unindexDce(dirCache_t *cache, dirCacheEntry_t *dce)
+{
+	unsigned int mask = cache->indexSize - 1;
+
+	if(!dce->indexed)
+		return;
+	dce->indexed = 0;
+	cache->nrIndexed--;
+	if(!cache->indexSize)
+		return;
+	if(dce->longName && *dce->longName)
+		unlinkChain(&cache->longIndex[dce->longHash & mask], dce, 1);
+	unlinkChain(&cache->shortIndex[dce->shortHash & mask], dce, 0);
+}
+
+/*
+ * Does the cache hold the whole directory, from its start up to the end
+ * mark, with all names indexed?
+ */
+int dirCacheComplete(dirCache_t *cache)
+{
+	dirCacheEntry_t *dce;
+
+	if(cache->indexFailed || !cache->nrCached)
+		return 0;
+	dce = findEntry(cache, cache->nrCached - 1);
+	return dce && dce->type == DCET_END;
+}
+
+/*
+ * Of the used entries whose long and/or short name (according to
+ * which) is name, ignoring case, return the first one whose main slot
+ * comes after slot after.  NULL if none.  Only exhaustive if
+ * dirCacheComplete
+ */
+dirCacheEntry_t *lookupNameInDircache(dirCache_t *cache, const wchar_t *name,
+				      int after, int which)
+{
+	uint32_t hash;
+	unsigned int mask;
+	dirCacheEntry_t *dce, *best = 0;
+
+	if(!cache->indexSize)
+		return 0;
+	hash = calcHash(name);
+	mask = cache->indexSize - 1;
+
+#define CONSIDER(dce)							\
+	if((int) (dce)->endSlot - 1 > after &&				\
+	   (!best || (dce)->beginSlot < best->beginSlot))		\
+		best = (dce)
+
+	if(which & DC_LONG)
+		for(dce = cache->longIndex[hash & mask]; dce;
+		    dce = dce->nextLong)
+			if(dce->longHash == hash && nameEq(dce->longName, name))
+				CONSIDER(dce);
+	if(which & DC_SHORT)
+		for(dce = cache->shortIndex[hash & mask]; dce;
+		    dce = dce->nextShort)
+			if(dce->shortHash == hash &&
+			   nameEq(dce->shortName, name))
+				CONSIDER(dce);
+#undef CONSIDER
+	return best;
 }
 
 int isHashed(dirCache_t *cache, wchar_t *name)
@@ -115,18 +491,18 @@ int growDirCache(dirCache_t *cache, unsigned int slot)
 		exit(1);
 	}
 
-	if( cache->nr_entries <= slot) {
+	if( cache->nrGroups <= slot / DC_GROUP_SLOTS) {
 		unsigned int i;
+		unsigned int n = (slot / DC_GROUP_SLOTS + 1) * 2;
+		unsigned int *hints;
 
-		cache->entries = realloc(cache->entries,
-					 (slot+1) * 2 *
-					 sizeof(dirCacheEntry_t *));
-		if(!cache->entries)
+		hints = realloc(cache->groupHints, n * sizeof(unsigned int));
+		if(!hints)
 			return -1;
-		for(i= cache->nr_entries; i < (slot+1) * 2; i++) {
-			cache->entries[i] = 0;
-		}
-		cache->nr_entries = (slot+1) * 2;
+		for(i= cache->nrGroups; i < n; i++)
+			hints[i] = 0;
+		cache->groupHints = hints;
+		cache->nrGroups = n;
 	}
 	return 0;
 }
@@ -145,15 +521,17 @@ dirCache_t *allocDirCache(Stream_t *Stream, unsigned int slot)
 		*dcp = New(dirCache_t);
 		if(!*dcp)
 			return 0;
-		(*dcp)->entries = NewArray((slot+1)*2+5, dirCacheEntry_t *);
-		if(!(*dcp)->entries) {
+		if(growDirCache(*dcp, slot) < 0) {
 			free(*dcp);
+			*dcp = 0;
+			return 0;
+		}
+		if(allocFilter(*dcp, DC_BITMAP_SIZE) < 0) {
+			free((*dcp)->groupHints);
+			free(*dcp);
+			*dcp = 0;
 			return 0;
 		}
-		(*dcp)->nr_entries = (slot+1) * 2;
-		memset( (*dcp)->bm0, 0, sizeof((*dcp)->bm0));
-		memset( (*dcp)->bm1, 0, sizeof((*dcp)->bm1));
-		memset( (*dcp)->bm2, 0, sizeof((*dcp)->bm1));
 		(*dcp)->nrHashed = 0;
 	} else
 		if(growDirCache(*dcp, slot) < 0)
@@ -176,7 +554,8 @@ static int freeDirCacheRange(dirCache_t *cache,
 	dirCacheEntry_t *entry;
 	unsigned int clearBegin;
 	unsigned int clearEnd;
-	unsigned int i;
+	unsigned int first, i;
+	int ret = -1;
 
 	if(endSlot < beginSlot) {
 		fprintf(stderr, "Bad slots %d %d in free range\n",
@@ -184,47 +563,38 @@ static int freeDirCacheRange(dirCache_t *cache,
 		exit(1);
 	}
 
-	while(beginSlot < endSlot) {
-		entry = cache->entries[beginSlot];
-		if(!entry) {
-			beginSlot++;
-			continue;
-		}
+	first = i = findSorted(cache, beginSlot);
+	while(i < cache->nrSorted && cache->sorted[i]->beginSlot < endSlot) {
+		entry = cache->sorted[i];
 
 		/* Due to the way this is called, we _always_ de-allocate
 		 * starting from beginning... */
 #ifdef HAVE_ASSERT_H
-		assert(entry->beginSlot == beginSlot);
+		assert(entry->beginSlot >= beginSlot);
 #endif
+		clearBegin = entry->beginSlot;
 		clearEnd = entry->endSlot;
 		if(clearEnd > endSlot)
 			clearEnd = endSlot;
-		clearBegin = beginSlot;
 
-		for(i = clearBegin; i <clearEnd; i++)
-			cache->entries[i] = 0;
+		if(clearBegin < cache->nrCached)
+			cache->nrCached = clearBegin;
+		unindexDce(cache, entry);
 
 		entry->beginSlot = clearEnd;
 
-		if(entry->beginSlot == entry->endSlot) {
-			int needWriteEnd = 0;
-			if(entry->endMarkPos != -1 &&
-			   entry->endMarkPos < (int) beginSlot)
-				needWriteEnd = 1;
-
-			if(entry->longName)
-				free(entry->longName);
-			if(entry->shortName)
-				free(entry->shortName);
-			free(entry);
-			if(needWriteEnd) {
-				return (int) beginSlot;
-			}
-		}
+		if(entry->beginSlot != entry->endSlot)
+			/* shortened, stays in place */
+			break;
 
-		beginSlot = clearEnd;
+		if(ret == -1 && entry->endMarkPos != -1 &&
+		   entry->endMarkPos < (int) clearBegin)
+			ret = (int) clearBegin;
+		freeDce(cache, entry);
+		i++;
 	}
-	return -1;
+	removeSorted(cache, first, i - first);
+	return ret;
 }
 
 static dirCacheEntry_t *allocDirCacheEntry(dirCache_t *cache,
@@ -238,7 +608,7 @@ static dirCacheEntry_t *allocDirCacheEntry(dirCache_t *cache,
 	if(growDirCache(cache, endSlot) < 0)
 		return 0;
 
-	entry = New(dirCacheEntry_t);
+	entry = newDce(cache);
 	if(!entry)
 		return 0;
 	entry->type = type;
@@ -249,9 +619,16 @@ static dirCacheEntry_t *allocDirCacheEntry(dirCache_t *cache,
 	entry->endMarkPos = -1;
 
 	freeDirCacheRange(cache, beginSlot, endSlot);
-	for(i=beginSlot; i<endSlot; i++) {
-		cache->entries[i] = entry;
+	if(insertSorted(cache, findSorted(cache, beginSlot), entry) < 0) {
+		freeDce(cache, entry);
+		return 0;
 	}
+	/* extend the cached prefix over any entries now joined to it */
+	for(i = findSorted(cache, cache->nrCached);
+	    i < cache->nrSorted &&
+		    cache->sorted[i]->beginSlot <= cache->nrCached;
+	    i++)
+		cache->nrCached = cache->sorted[i]->endSlot;
 	return entry;
 }
 
@@ -278,10 +655,11 @@ dirCacheEntry_t *addUsedEntry(dirCache_t *cache,
 	entry->beginSlot = beginSlot;
 	entry->endSlot = endSlot;
 	if(longName)
-		entry->longName = wcsdup(longName);
-	entry->shortName = wcsdup(shortName);
+		entry->longName = chunkWcsdup(cache, longName);
+	entry->shortName = chunkWcsdup(cache, shortName);
 	entry->dir = *dir;
 	hashDce(cache, entry);
+	indexDce(cache, entry);
 	return entry;
 }
 
@@ -297,15 +675,17 @@ static void mergeFreeSlots(dirCache_t *cache, unsigned int slot)
 
 	if(slot == 0)
 		return;
-	previous = cache->entries[slot-1];
-	next = cache->entries[slot];
-	if(next && next->type == DCET_FREE &&
-	   previous && previous->type == DCET_FREE) {
-		for(i=next->beginSlot; i < next->endSlot; i++)
-			cache->entries[i] = previous;
+	i = findSorted(cache, slot-1);
+	if(i + 1 >= cache->nrSorted)
+		return;
+	previous = cache->sorted[i];
+	next = cache->sorted[i+1];
+	if(previous->endSlot == slot && next->beginSlot == slot &&
+	   next->type == DCET_FREE && previous->type == DCET_FREE) {
 		previous->endSlot = next->endSlot;
 		previous->endMarkPos = next->endMarkPos;
-		free(next);
+		freeDce(cache, next);
+		removeSorted(cache, i+1, 1);
 	}
 }
 
@@ -330,11 +710,13 @@ dirCacheEntry_t *addFreeEndEntry(dirCache_t *cache,
 	if(endSlot == beginSlot)
 		return 0;
 	entry = allocDirCacheEntry(cache, beginSlot, endSlot, DCET_FREE);
+	if(!entry)
+		return 0;
 	if(isAtEnd)
 		entry->endMarkPos = (int) beginSlot;
 	mergeFreeSlots(cache, beginSlot);
 	mergeFreeSlots(cache, endSlot);
-	return cache->entries[beginSlot];
+	return findEntry(cache, beginSlot);
 }
 
 dirCacheEntry_t *addFreeEntry(dirCache_t *cache,
@@ -353,20 +735,41 @@ dirCacheEntry_t *lookupInDircache(dirCache_t *cache, unsigned int pos)
 {
 	if(growDirCache(cache, pos+1) < 0)
 		return 0;
-	return cache->entries[pos];
+	return findEntry(cache, pos);
 }
 
 void freeDirCache(Stream_t *Stream)
 {
 	dirCache_t *cache, **dcp;
+	dirCacheChunk_t *chunk;
 
 	dcp = getDirCacheP(Stream);
 	cache = *dcp;
 	if(cache) {
-		int n;
-		n=freeDirCacheRange(cache, 0, cache->nr_entries);
+		int n = -1;
+		if(cache->nrSorted)
+			n=freeDirCacheRange(cache, 0,
+					    cache->sorted[cache->nrSorted-1]->endSlot);
 		if(n >= 0)
 			low_level_dir_write_end(Stream, n);
+		dropIndex(cache);
+#ifdef DEBUG
+		if(cache->nrFilterHits)
+			fprintf(stderr,
+				"dircache filter: %u of %u hits false, %u names in %u bits\n",
+				cache->nrFilterFalse, cache->nrFilterHits,
+				cache->nrNamesHashed,
+				cache->bmSize * (unsigned int) BITS_PER_INT);
+#endif
+		free(cache->bm0);
+		while((chunk = cache->chunks)) {
+			cache->chunks = chunk->next;
+			free(chunk);
+		}
+		free(cache->sorted);
+		free(cache->groupHints);
+		if(cache->scanBuf)
+			free(cache->scanBuf);
 		free(cache);
 		*dcp = 0;
 	}
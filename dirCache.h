@@ -25,17 +25,72 @@ typedef enum {
 	DCET_END
 } dirCacheEntryType_t;
 
+/* Initial size of each filter bitmap, in ints.  Doubled whenever
+ * there are more than DC_BITS_PER_NAME bits per hashed name */
 #define DC_BITMAP_SIZE 128
+#define DC_BITS_PER_NAME 8
+
+/* Slots per group of the lookup hints: 2K of directory, a cluster on
+ * most filesystems */
+#define DC_GROUP_SLOTS 64
 
 typedef struct dirCacheEntry_t dirCacheEntry_t;
 
+/* which names lookupNameInDircache compares */
+#define DC_LONG 1
+#define DC_SHORT 2
+
 typedef struct dirCache_t {
-	struct dirCacheEntry_t **entries;
-	unsigned int nr_entries;
+	/* Cached entries, sorted by beginSlot.  Slots which are not in
+	 * the cache lie between entries */
+	struct dirCacheEntry_t **sorted;
+	unsigned int nrSorted;
+	unsigned int sortedAllocated;
+
+	/* For each group of DC_GROUP_SLOTS slots, where in sorted the
+	 * search for its first slot ended last time.  Only a hint,
+	 * checked before use */
+	unsigned int *groupHints;
+	unsigned int nrGroups;
+
 	unsigned int nrHashed;
-	unsigned int bm0[DC_BITMAP_SIZE];
-	unsigned int bm1[DC_BITMAP_SIZE];
-	unsigned int bm2[DC_BITMAP_SIZE];
+
+	/* Bloom filter of the names of the first nrHashed slots: three
+	 * bitmaps of bmSize ints, in one allocation starting at bm0 */
+	unsigned int *bm0;
+	unsigned int *bm1;
+	unsigned int *bm2;
+	unsigned int bmSize;
+	unsigned int nrNamesHashed;
+
+	/* Filter statistics: names found in the filter and then checked
+	 * by a scan, and how many of these turned out not to be in the
+	 * directory */
+	unsigned int nrFilterHits;
+	unsigned int nrFilterFalse;
+
+	/* Index of used entries by case folded name: hash tables of
+	 * long and of short names, chained through the entries */
+	struct dirCacheEntry_t **longIndex;
+	struct dirCacheEntry_t **shortIndex;
+	unsigned int indexSize; /* number of buckets, a power of 2 */
+	unsigned int nrIndexed;
+	int indexFailed; /* out of memory, index incomplete */
+
+	unsigned int nrCached; /* number of leading slots in the cache */
+
+	/* Entries and their names are carved out of these chunks, which
+	 * are only released along with the cache.  Freed entries are
+	 * kept for reuse */
+	struct dirCacheChunk_t *chunks;
+	struct dirCacheEntry_t *freeEntries;
+
+	/* Raw directory slots scanBegin up to scanEnd, as read ahead by
+	 * dir_read_batch */
+	char *scanBuf;
+	size_t scanBufSize;
+	unsigned int scanBegin;
+	unsigned int scanEnd;
 } dirCache_t;
 
 int growDirCache(dirCache_t *cache, unsigned int slot);
@@ -48,4 +103,7 @@ dirCacheEntry_t *addFreeEndEntry(dirCache_t *Stream,
 				 int isAtEnd);
 dirCacheEntry_t *addEndEntry(dirCache_t *Stream, unsigned int pos);
 dirCacheEntry_t *lookupInDircache(dirCache_t *Stream, unsigned int pos);
+int dirCacheComplete(dirCache_t *cache);
+dirCacheEntry_t *lookupNameInDircache(dirCache_t *cache, const wchar_t *name,
+				      int after, int which);
 #endif
@@ -9,6 +9,13 @@ struct dirCacheEntry_t {
 	wchar_t *longName;
 	struct directory dir;
 	int endMarkPos;
+
+	/* links in the name index of the cache (used entries only) */
+	int indexed;
+	uint32_t longHash;
+	uint32_t shortHash;
+	struct dirCacheEntry_t *nextLong;
+	struct dirCacheEntry_t *nextShort;
 } ;
 
 int isHashed(dirCache_t *cache, wchar_t *name);
@@ -21,6 +21,7 @@
 #include "file.h"
 #include "fs.h"
 #include "file_name.h"
+#include "dirCache.h"
 
 /* #define DEBUG */
 
@@ -42,6 +43,84 @@ struct directory *dir_read(direntry_t *entry, int *error)
 	return &entry->dir;
 }
 
+/* How much of a directory dir_read_batch reads at once: a cluster, or
+ * all of a FAT12/16 root directory */
+static size_t dir_batch_size(Stream_t *Dir)
+{
+	mt_off_t size;
+
+	if(isRootDir(Dir) && GET_DATA(Dir, 0, &size, 0, 0) == 0 && size > 0)
+		return (size_t) size;
+	return getFileClusterBytes(Dir);
+}
+
+/*
+ * Like dir_read, but reads a whole batch of entries into a buffer of
+ * the directory cache, and serves the following entries from there.
+ * Saves a trip through the stream stack for every entry when scanning
+ * a directory
+ */
+struct directory *dir_read_batch(direntry_t *entry, dirCache_t *cache,
+				 int *error)
+{
+	unsigned int slot = getEntryAsPos(entry);
+	unsigned int begin;
+	size_t size;
+	ssize_t n;
+
+	*error = 0;
+	if(slot < cache->scanBegin || slot >= cache->scanEnd) {
+		if(!cache->scanBuf) {
+			size = dir_batch_size(entry->Dir);
+			size = ROUND_DOWN(size, MDIR_SIZE);
+			if(size <= MDIR_SIZE)
+				return dir_read(entry, error);
+			cache->scanBuf = malloc(size);
+			if(!cache->scanBuf)
+				return dir_read(entry, error);
+			cache->scanBufSize = size;
+		}
+		begin = ROUND_DOWN(slot,
+				   (unsigned int)(cache->scanBufSize / MDIR_SIZE));
+		cache->scanBegin = cache->scanEnd = 0;
+		n = force_pread(entry->Dir, cache->scanBuf,
+				(mt_off_t) begin * MDIR_SIZE,
+				cache->scanBufSize);
+		if(n < 0) {
+			*error = -1;
+			return NULL;
+		}
+		cache->scanBegin = begin;
+		cache->scanEnd = begin + (unsigned int) n / MDIR_SIZE;
+		if(slot >= cache->scanEnd)
+			return NULL;
+	}
+	memcpy(&entry->dir,
+	       cache->scanBuf + (size_t) (slot - cache->scanBegin) * MDIR_SIZE,
+	       MDIR_SIZE);
+	return &entry->dir;
+}
+
+/* Keep the entries read ahead by dir_read_batch in line with what has
+ * been written */
+static void dir_batch_written(Stream_t *Dir, const char *buf,
+			      mt_off_t start, size_t len)
+{
+	dirCache_t *cache = *getDirCacheP(Dir);
+	mt_off_t bufStart, from, to;
+
+	if(!cache || cache->scanEnd <= cache->scanBegin)
+		return;
+	bufStart = (mt_off_t) cache->scanBegin * MDIR_SIZE;
+	from = start > bufStart ? start : bufStart;
+	to = (mt_off_t) cache->scanEnd * MDIR_SIZE;
+	if(start + (mt_off_t) len < to)
+		to = start + (mt_off_t) len;
+	if(from < to)
+		memcpy(cache->scanBuf + (from - bufStart), buf + (from - start),
+		       (size_t) (to - from));
+}
+
 /*
  * Make a subdirectory grow in length.  Only subdirectories (not root)
  * may grow.  Returns a 0 on success, 1 on failure (disk full), or -1
@@ -68,6 +147,9 @@ int dir_grow(Stream_t *Dir, unsigned int size)
 
 	memset((char *) buffer, '\0', buflen);
 	ret = force_pwrite(Dir, buffer, (mt_off_t) size * MDIR_SIZE, buflen);
+	if(ret == (ssize_t) buflen)
+		dir_batch_written(Dir, buffer, (mt_off_t) size * MDIR_SIZE,
+				  buflen);
 	free(buffer);
 	if(ret < (int) buflen)
 		return -1;
@@ -77,15 +159,20 @@ int dir_grow(Stream_t *Dir, unsigned int size)
 
 void low_level_dir_write(direntry_t *entry)
 {
-	force_pwrite(entry->Dir,
-		     (char *) (&entry->dir),
-		     (mt_off_t) entry->entry * MDIR_SIZE, MDIR_SIZE);
+	if(force_pwrite(entry->Dir,
+			(char *) (&entry->dir),
+			(mt_off_t) entry->entry * MDIR_SIZE,
+			MDIR_SIZE) == MDIR_SIZE)
+		dir_batch_written(entry->Dir, (char *) (&entry->dir),
+				  (mt_off_t) entry->entry * MDIR_SIZE,
+				  MDIR_SIZE);
 }
 
 void low_level_dir_write_end(Stream_t *Dir, int entry)
 {
 	char zero = ENDMARK;
-	force_pwrite(Dir, &zero, (mt_off_t) entry * MDIR_SIZE, 1);
+	if(force_pwrite(Dir, &zero, (mt_off_t) entry * MDIR_SIZE, 1) == 1)
+		dir_batch_written(Dir, &zero, (mt_off_t) entry * MDIR_SIZE, 1);
 }
 
 /*
@@ -22,6 +22,8 @@
 #include "mtools.h"
 #include "fsP.h"
 #include "file_name.h"
+#include "fat_scan.h"
+#include "plain_io.h"
 
 #if defined HAVE_LONG_LONG && defined __STDC_VERSION__
 typedef long long fatBitMask;
@@ -33,6 +35,8 @@ typedef struct FatMap_t {
 	unsigned char *data;
 	fatBitMask dirty;
 	fatBitMask valid;
+	fatBitMask mirrorDirty; /* still to be copied to the other FATs
+				 * (MTOOLS_LAZY_FAT_MIRROR) */
 } FatMap_t;
 
 #define SECT_PER_ENTRY (sizeof(fatBitMask)*8)
@@ -78,6 +82,7 @@ static FatMap_t *GetFatMap(Fs_t *Stream)
 		map[i].data = 0;
 		map[i].valid = 0;
 		map[i].dirty = 0;
+		map[i].mirrorDirty = 0;
 	}
 
 	return map;
@@ -136,24 +141,138 @@ static inline ssize_t fatReadSector(Fs_t *This,
 }
 
 
-static ssize_t fatWriteSector(Fs_t *This,
-			      unsigned int sector,
-			      unsigned int slot,
-			      unsigned int bit,
-			      unsigned int dupe)
+/*
+ * Write nr sectors of the FAT, starting at sector, to FAT copy dupe.
+ * The sectors must be contiguous in memory
+ */
+static ssize_t fatWriteSectors(Fs_t *This,
+			       unsigned int sector,
+			       unsigned int nr,
+			       unsigned int dupe)
 {
 	unsigned int fat_start;
+	unsigned int slot = sector / SECT_PER_ENTRY;
+	unsigned int bit = sector % SECT_PER_ENTRY;
 
 	dupe = (dupe + This->primaryFat) % This->num_fat;
 	if(dupe && !This->writeAllFats)
-		return This->sector_size;
+		return (ssize_t) nr << This->sectorShift;
 
 	fat_start = This->fat_start + This->fat_len * dupe;
 
 	return forceWriteSector(This,
 				(char *)
 				(This->FatMap[slot].data + bit * This->sector_size),
-				fat_start+sector, 1);
+				fat_start+sector, nr);
+}
+
+static inline fatBitMask dirtyMask(Fs_t *This, unsigned int slot, int mirror)
+{
+	return mirror ? This->FatMap[slot].mirrorDirty :
+		This->FatMap[slot].dirty;
+}
+
+static inline int isDirty(Fs_t *This, unsigned int sector, int mirror)
+{
+	return (dirtyMask(This, sector / SECT_PER_ENTRY, mirror) &
+		(ONE << (sector % SECT_PER_ENTRY))) != 0;
+}
+
+/*
+ * Number of consecutive dirty sectors starting at sector, which can
+ * be written in one go.  Without bulk load, different slots are not
+ * contiguous in memory, so runs stop at the end of a slot
+ */
+static unsigned int dirtyRunLength(Fs_t *This, unsigned int sector,
+				   int mirror)
+{
+	unsigned int end = sector;
+
+	while(end < This->fat_len && isDirty(This, end, mirror)) {
+		end++;
+		if(!This->fatBulk && end % SECT_PER_ENTRY == 0)
+			break;
+	}
+	return end - sector;
+}
+
+/*
+ * Write all runs of dirty sectors (or of sectors not yet mirrored, if
+ * mirror is set) to FAT copy dupe.  All errors are fatal.
+ */
+static void writeDirtyRuns(Fs_t *This, unsigned int dupe, int mirror)
+{
+	unsigned int j, nr;
+	ssize_t ret;
+
+	j = 0;
+	while(j<This->fat_len) {
+		if(j % SECT_PER_ENTRY == 0 &&
+		   !dirtyMask(This, j / SECT_PER_ENTRY, mirror)) {
+			j += SECT_PER_ENTRY;
+			continue;
+		}
+		if(!isDirty(This, j, mirror)) {
+			j++;
+			continue;
+		}
+		/* write out whole run of adjacent dirty sectors */
+		nr = dirtyRunLength(This, j, mirror);
+		ret = fatWriteSectors(This, j, nr, dupe);
+		if (ret < (ssize_t) nr << This->sectorShift){
+			if (ret < 0 ){
+				perror("error in fat_write");
+				exit(1);
+			} else {
+				fprintf(stderr,
+					"end of file in fat_write\n");
+				exit(1);
+			}
+		}
+		j += nr;
+	}
+}
+
+/*
+ * Lazy mirror mode: only the primary FAT is written during the
+ * session.  Bring the other copies up to date when the filesystem is
+ * closed.  If the whole FAT is in memory, this is one write per copy,
+ * spanning all sectors changed during the session.
+ */
+static void fat_sync_mirrors(Fs_t *This)
+{
+	unsigned int i, j, first, end;
+	unsigned int slot;
+	ssize_t ret;
+
+	if(This->fat_error || This->num_fat < 2)
+		goto done;
+
+	if(!This->fatBulk) {
+		for(i=1; i < This->num_fat; i++)
+			writeDirtyRuns(This, i, 1);
+		goto done;
+	}
+
+	first = end = 0;
+	for(j=0; j < This->fat_len; j++)
+		if(isDirty(This, j, 1)) {
+			if(end == 0)
+				first = j;
+			end = j + 1;
+		}
+	if(end == 0)
+		return;
+	for(i=1; i < This->num_fat; i++) {
+		ret = fatWriteSectors(This, first, end - first, i);
+		if(ret < (ssize_t) (end - first) << This->sectorShift) {
+			perror("error syncing fat mirror");
+			exit(1);
+		}
+	}
+ done:
+	for(slot=0; slot * SECT_PER_ENTRY < This->fat_len; slot++)
+		This->FatMap[slot].mirrorDirty = 0;
 }
 
 static unsigned char *loadSector(Fs_t *This,
@@ -440,10 +559,46 @@ static void fast_fat32_encode(Fs_t *Stream, unsigned int num, unsigned int code)
  * to wait till the end of the program to write the table.  Oh well...)
  */
 
+static void punchClusters(Fs_t *This, uint32_t first, uint32_t n)
+{
+	mt_off_t start = sectorsToBytes(This, (first - 2) * This->cluster_size +
+					This->clus_start);
+	mt_off_t len = sectorsToBytes(This, n * This->cluster_size);
+	int fd;
+
+	/* also writes back the FAT, before its clusters disappear */
+	fd = get_raw_fd(This->head.Next, &start);
+	if(fd >= 0)
+		punch_hole(fd, start, len);
+}
+
+/*
+ * Punch out clusters freed since the last FAT write, skipping those
+ * which have been allocated again in the meantime
+ */
+static void punchFreedRuns(Fs_t *This)
+{
+	uint32_t i, clus, end, first;
+
+	for(i=0; i < This->nrFreedRuns; i++) {
+		clus = This->freedRuns[i].start;
+		end = clus + This->freedRuns[i].len;
+		while(clus < end) {
+			while(clus < end && fatDecode(This, clus))
+				clus++;
+			first = clus;
+			while(clus < end && !fatDecode(This, clus))
+				clus++;
+			if(clus > first)
+				punchClusters(This, first, clus - first);
+		}
+	}
+	This->nrFreedRuns = 0;
+}
+
 void fat_write(Fs_t *This)
 {
-	unsigned int i, j, dups, bit, slot;
-	ssize_t ret;
+	unsigned int i, dups, slot;
 
 	/*fprintf(stderr, "Fat write\n");*/
 
@@ -451,38 +606,16 @@ void fat_write(Fs_t *This)
 		return;
 
 	dups = This->num_fat;
-	if (This->fat_error)
+	if (This->fat_error || mtools_lazy_fat_mirror)
 		dups = 1;
 
-
-	for(i=0; i<dups; i++){
-		j = 0;
-		for(slot=0;j<This->fat_len;slot++) {
-			if(!This->FatMap[slot].dirty) {
-				j += SECT_PER_ENTRY;
-				continue;
-			}
-			for(bit=0;
-			    bit < SECT_PER_ENTRY && j<This->fat_len;
-			    bit++,j++) {
-				if(!(This->FatMap[slot].dirty & (ONE << bit)))
-					continue;
-				ret = fatWriteSector(This,j,slot, bit, i);
-				if (ret < (int) This->sector_size){
-					if (ret < 0 ){
-						perror("error in fat_write");
-						exit(1);
-					} else {
-						fprintf(stderr,
-							"end of file in fat_write\n");
-						exit(1);
-					}
-				}
-				/* if last dupe, zero it out */
-				if(i==dups-1)
-					This->FatMap[slot].dirty &= ~(ONE<<bit);
-			}
-		}
+	for(i=0; i<dups; i++)
+		writeDirtyRuns(This, i, 0);
+	for(slot=0; slot * SECT_PER_ENTRY < This->fat_len; slot++) {
+		if(mtools_lazy_fat_mirror)
+			This->FatMap[slot].mirrorDirty |=
+				This->FatMap[slot].dirty;
+		This->FatMap[slot].dirty = 0;
 	}
 	/* write the info sector, if any */
 	if(This->infoSectorLoc && This->infoSectorLoc != MAX32) {
@@ -508,6 +641,9 @@ void fat_write(Fs_t *This)
 	}
 	This->fat_dirty = 0;
 	This->lastFatAccessMode = FAT_ACCESS_READ;
+
+	if(This->nrFreedRuns)
+		punchFreedRuns(This);
 }
 
 
@@ -625,6 +761,127 @@ void set_fat(Fs_t *This, bool haveBigFatLen) {
 		set_fat32(This);
 }
 
+/*
+ * Whole FAT bulk load.  The primary FAT is read with one big read into
+ * a contiguous buffer, which then backs all FatMap slots, and is
+ * decoded into a flat array of cluster numbers.  Decoding then is a
+ * simple array lookup.  Encoding goes through the usual byte level
+ * encoder (which marks the touched sectors dirty for fat_write), and
+ * updates the flat array.
+ */
+
+static unsigned int bulk_fat_decode(Fs_t *Stream, unsigned int num)
+{
+	if(num < 2 || num >= Stream->fatTableLen)
+		return Stream->raw_fat_decode(Stream, num);
+	return Stream->fatTable[num];
+}
+
+static void bulk_fat_encode(Fs_t *Stream, unsigned int num, unsigned int code)
+{
+	Stream->raw_fat_encode(Stream, num, code);
+	if(num < Stream->fatTableLen)
+		Stream->fatTable[num] = code & Stream->end_fat;
+}
+
+/* Number of entries which entirely fit into a FAT of the given size */
+static uint32_t entriesInFat(Fs_t *This, size_t fat_bytes)
+{
+	size_t entries;
+
+	if(This->fat_bits == 12)
+		entries = fat_bytes / 3 * 2 + (fat_bytes % 3 == 2);
+	else
+		entries = fat_bytes * 8 / This->fat_bits;
+	if(entries > This->num_clus + 2)
+		entries = This->num_clus + 2;
+	return (uint32_t) entries;
+}
+
+static void decodeBulkFat(Fs_t *This)
+{
+	uint32_t i;
+	unsigned char *p = This->fatBulk;
+
+	switch(This->fat_bits) {
+	case 12:
+		for(i=0; i < This->fatTableLen; i++) {
+			p = This->fatBulk + i * 3 / 2;
+			if(i & 1)
+				This->fatTable[i] = ((uint32_t)p[1] << 4) |
+					((uint32_t)p[0] >> 4);
+			else
+				This->fatTable[i] =
+					(((uint32_t)p[1] & 0xf) << 8) | p[0];
+		}
+		break;
+	case 16:
+		for(i=0; i < This->fatTableLen; i++, p += 2)
+			This->fatTable[i] = WORD(p);
+		break;
+	default:
+		for(i=0; i < This->fatTableLen; i++, p += 4)
+			This->fatTable[i] = DWORD(p) & FAT32_ADDR;
+		break;
+	}
+}
+
+static void fatBulkLoad(Fs_t *This)
+{
+	size_t nr_slots, i;
+	size_t slot_size;
+	size_t fat_bytes;
+	unsigned char *bulk;
+	uint32_t *table;
+	uint32_t nr_entries;
+	unsigned int fat_start;
+
+	nr_slots = (This->fat_len + SECT_PER_ENTRY - 1) / SECT_PER_ENTRY;
+	slot_size = This->sector_size * SECT_PER_ENTRY;
+	fat_bytes = (size_t) This->fat_len << This->sectorShift;
+	nr_entries = entriesInFat(This, fat_bytes);
+
+	bulk = malloc(nr_slots * slot_size);
+	table = NewArray(nr_entries, uint32_t);
+	if(!bulk || !table)
+		goto fallback;
+
+	fat_start = This->fat_start +
+		This->fat_len * (This->primaryFat % This->num_fat);
+	if(force_pread(This->head.Next, (char *) bulk,
+		       sectorsToBytes(This, fat_start), fat_bytes) !=
+	   (ssize_t) fat_bytes)
+		/* Let the piecewise loader deal with bad sectors and
+		 * alternate FAT copies */
+		goto fallback;
+
+	for(i=0; i < nr_slots; i++) {
+		if(This->FatMap[i].data)
+			free(This->FatMap[i].data);
+		This->FatMap[i].data = bulk + i * slot_size;
+		This->FatMap[i].valid = ~(fatBitMask) 0;
+		This->FatMap[i].dirty = 0;
+	}
+	This->lastFatSectorNr = 0;
+	This->lastFatSectorData = 0;
+
+	This->fatBulk = bulk;
+	This->fatTable = table;
+	This->fatTableLen = nr_entries;
+	decodeBulkFat(This);
+
+	This->raw_fat_decode = This->fat_decode;
+	This->raw_fat_encode = This->fat_encode;
+	This->fat_decode = bulk_fat_decode;
+	This->fat_encode = bulk_fat_encode;
+	return;
+ fallback:
+	if(bulk)
+		free(bulk);
+	if(table)
+		free(table);
+}
+
 static int check_fat(Fs_t *This)
 {
 	/*
@@ -682,6 +939,9 @@ static int check_media_type(Fs_t *This, union bootsector *boot)
 		return -1;
 	}
 
+	if(mtools_fat_bulk_load)
+		fatBulkLoad(This);
+
 	address = getAddress(This, 0, FAT_ACCESS_READ);
 	if(!address) {
 		fprintf(stderr,
@@ -800,27 +1060,246 @@ unsigned int fatDecode(Fs_t *This, unsigned int pos)
 	return ret;
 }
 
+/*
+ * Free cluster bitmap.  Each chunk of FREE_CHUNK_SIZE clusters is
+ * filled in by decoding its FAT entries the first time it is needed,
+ * and kept up to date by the allocation functions below.  Searching
+ * for free clusters then skips full chunks using the per-chunk free
+ * counts, and scans the rest of the bitmap a word at a time.
+ */
+#define FREE_CHUNK_SIZE 4096
+#define CHUNK_UNKNOWN MAX32
+#define BITS_PER_WORD (sizeof(unsigned long)*8)
+
+static inline unsigned int lowestBit(unsigned long w)
+{
+#ifdef __GNUC__
+	return (unsigned int) __builtin_ctzl(w);
+#else
+	unsigned int n = 0;
+	while(!(w & 1)) {
+		w >>= 1;
+		n++;
+	}
+	return n;
+#endif
+}
+
+static void initFreeMap(Fs_t *This)
+{
+	uint32_t i;
+	size_t nr_words;
+
+	This->nrFreeChunks = (This->num_clus + 2 + FREE_CHUNK_SIZE - 1) /
+		FREE_CHUNK_SIZE;
+	nr_words = This->nrFreeChunks * (FREE_CHUNK_SIZE / BITS_PER_WORD);
+	This->freeMap = safe_malloc(nr_words * sizeof(unsigned long));
+	memset(This->freeMap, 0, nr_words * sizeof(unsigned long));
+	This->freeChunkCount =
+		safe_malloc(This->nrFreeChunks * sizeof(uint32_t));
+	for(i=0; i < This->nrFreeChunks; i++)
+		This->freeChunkCount[i] = CHUNK_UNKNOWN;
+	This->maxFreeRun = MAX32;
+}
+
+/*
+ * Pointer to the raw FAT data of entries [start,end), or NULL if
+ * these are not contiguous in memory.  start must be a multiple of
+ * FREE_CHUNK_SIZE.  Without bulk load, FAT16 and FAT32 chunks always
+ * lie within a single FatMap slot, as both sizes are powers of two,
+ * and a slot is bigger.  FAT12 entries may straddle slots.
+ */
+static unsigned char *rawFatEntries(Fs_t *This, uint32_t start, uint32_t end)
+{
+	size_t first, last;
+	unsigned int sector, firstSector;
+	unsigned char *base = 0;
+
+	first = (size_t) start * This->fat_bits / 8;
+	last = ((size_t) end * This->fat_bits + 7) / 8;
+	if(last > (size_t) This->fat_len << This->sectorShift)
+		return 0;
+	if(This->fatBulk)
+		return This->fatBulk + first;
+	if(This->fat_bits == 12)
+		return 0;
+
+	firstSector = (unsigned int) (first >> This->sectorShift);
+	for(sector = firstSector;
+	    sector <= (last - 1) >> This->sectorShift;
+	    sector++) {
+		unsigned char *p = loadSector(This, sector,
+					      FAT_ACCESS_READ, 0);
+		if(!p)
+			return 0;
+		if(!base)
+			base = p;
+		else if(p != base + ((sector - firstSector) <<
+				     This->sectorShift))
+			return 0;
+	}
+	return base + (first & This->sectorMask);
+}
+
+/*
+ * Returns the number of free clusters in the given chunk, reading it
+ * in from the FAT if needed.  Returns -1 on FAT error.
+ */
+static int freeChunkCount(Fs_t *This, uint32_t chunk)
+{
+	uint32_t i, start, end, count;
+	unsigned char *fat;
+
+	if(!This->freeMap)
+		initFreeMap(This);
+	if(This->freeChunkCount[chunk] != CHUNK_UNKNOWN)
+		return (int) This->freeChunkCount[chunk];
+
+	start = chunk * FREE_CHUNK_SIZE;
+	end = start + FREE_CHUNK_SIZE;
+	if(end > This->num_clus + 2)
+		end = This->num_clus + 2;
+
+	fat = rawFatEntries(This, start, end);
+	if(fat) {
+		int r = fat_scan_chunk(fat, This->fat_bits, start, end - start,
+				       This->num_clus + 1, This->last_fat,
+				       &This->freeMap[start / BITS_PER_WORD]);
+		if(r >= 0) {
+			This->freeChunkCount[chunk] = (uint32_t) r;
+			return r;
+		}
+		/* bad entries: decode them one by one below, so that
+		 * they get reported and counted in fat_error */
+	}
+
+	if(start < 2)
+		start = 2;
+	count = 0;
+	for(i=start; i < end; i++) {
+		unsigned int r = fatDecode(This, i);
+		if(r == 1)
+			return -1;
+		if(!r) {
+			This->freeMap[i / BITS_PER_WORD] |=
+				1ul << (i % BITS_PER_WORD);
+			count++;
+		}
+	}
+	This->freeChunkCount[chunk] = count;
+	return (int) count;
+}
+
+/* Keep free cluster bitmap in sync with a FAT change */
+static void freeMapSet(Fs_t *This, unsigned int pos, int isFree)
+{
+	uint32_t chunk;
+	unsigned long *word;
+	unsigned long mask;
+
+	if(!This->freeMap || pos < 2 || pos >= This->num_clus + 2)
+		return;
+	chunk = pos / FREE_CHUNK_SIZE;
+	if(This->freeChunkCount[chunk] == CHUNK_UNKNOWN)
+		return;
+	word = &This->freeMap[pos / BITS_PER_WORD];
+	mask = 1ul << (pos % BITS_PER_WORD);
+	if(isFree && !(*word & mask)) {
+		*word |= mask;
+		This->freeChunkCount[chunk]++;
+		This->maxFreeRun = MAX32;
+	} else if(!isFree && (*word & mask)) {
+		*word &= ~mask;
+		This->freeChunkCount[chunk]--;
+	}
+}
+
+/*
+ * Find first free cluster in [from,to).  Returns 0 if there is none,
+ * and 1 on FAT error.
+ */
+static unsigned int findFreeCluster(Fs_t *This, uint32_t from, uint32_t to)
+{
+	uint32_t i = from;
+
+	while(i < to) {
+		uint32_t chunk = i / FREE_CHUNK_SIZE;
+		uint32_t chunkEnd = (chunk + 1) * FREE_CHUNK_SIZE;
+		int count = freeChunkCount(This, chunk);
+
+		if(count < 0)
+			return 1;
+		if(chunkEnd > to)
+			chunkEnd = to;
+		while(count && i < chunkEnd) {
+			unsigned long w = This->freeMap[i / BITS_PER_WORD] >>
+				(i % BITS_PER_WORD);
+			if(w) {
+				i += lowestBit(w);
+				if(i < chunkEnd)
+					return i;
+				break;
+			}
+			i = ROUND_DOWN(i, BITS_PER_WORD) + BITS_PER_WORD;
+		}
+		i = chunkEnd;
+	}
+	return 0;
+}
+
 /* append a new cluster */
 void fatAppend(Fs_t *This, unsigned int pos, unsigned int newpos)
 {
 	This->fat_encode(This, pos, newpos);
 	This->fat_encode(This, newpos, This->end_fat);
+	freeMapSet(This, newpos, 0);
 	if(This->freeSpace != MAX32)
 		This->freeSpace--;
 }
 
+/* Remember a freed cluster, to punch it out of a sparse image */
+static void rememberFreed(Fs_t *This, unsigned int pos)
+{
+	FreedRun_t *run;
+
+	if(This->nrFreedRuns) {
+		run = &This->freedRuns[This->nrFreedRuns - 1];
+		if(run->start + run->len == pos) {
+			run->len++;
+			return;
+		}
+	}
+	if(This->nrFreedRuns == This->freedRunsAllocated) {
+		uint32_t n = This->freedRunsAllocated ?
+			2 * This->freedRunsAllocated : 16;
+		run = realloc(This->freedRuns, n * sizeof(FreedRun_t));
+		if(!run)
+			/* only costs some space on the host */
+			return;
+		This->freedRuns = run;
+		This->freedRunsAllocated = n;
+	}
+	run = &This->freedRuns[This->nrFreedRuns++];
+	run->start = pos;
+	run->len = 1;
+}
+
 /* de-allocates the given cluster */
 void fatDeallocate(Fs_t *This, unsigned int pos)
 {
 	This->fat_encode(This, pos, 0);
+	freeMapSet(This, pos, 1);
 	if(This->freeSpace != MAX32)
 		This->freeSpace++;
+	if(mtools_sparse_image)
+		rememberFreed(This, pos);
 }
 
 /* allocate a new cluster */
 void fatAllocate(Fs_t *This, unsigned int pos, unsigned int value)
 {
 	This->fat_encode(This, pos, value);
+	freeMapSet(This, pos, 0);
 	if(This->freeSpace != MAX32)
 		This->freeSpace--;
 }
@@ -829,6 +1308,7 @@ void fatEncode(Fs_t *This, unsigned int pos, unsigned int value)
 {
 	unsigned int oldvalue = This->fat_decode(This, pos);
 	This->fat_encode(This, pos, value);
+	freeMapSet(This, pos, !value);
 	if(This->freeSpace != MAX32) {
 		if(oldvalue)
 			This->freeSpace++;
@@ -848,27 +1328,16 @@ unsigned int get_next_free_cluster(Fs_t *This, unsigned int last)
 	    last >= This->num_clus+1)
 		last = 1;
 
-	for (i=last+1; i< This->num_clus+2; i++) {
-		unsigned int r = fatDecode(This, i);
-		if(r == 1)
-			goto exit_0;
-		if (!r) {
-			This->last = i;
-			return i;
-		}
+	i = findFreeCluster(This, last+1, This->num_clus+2);
+	if(!i)
+		i = findFreeCluster(This, 2, last+1);
+	if(i == 1)
+		goto exit_0;
+	if(i) {
+		This->last = i;
+		return i;
 	}
 
-	for(i=2; i < last+1; i++) {
-		unsigned int r = fatDecode(This, i);
-		if(r == 1)
-			goto exit_0;
-		if (!r) {
-			This->last = i;
-			return i;
-		}
-	}
-
-
 	fprintf(stderr,"No free cluster %d %d\n", This->preallocatedClusters,
 		This->last);
 	return 1;
@@ -877,6 +1346,108 @@ unsigned int get_next_free_cluster(Fs_t *This, unsigned int last)
 	return 1;
 }
 
+/*
+ * Find end of the run of free clusters starting at from (first used
+ * cluster after it, or to)
+ */
+static uint32_t findRunEnd(Fs_t *This, uint32_t from, uint32_t to)
+{
+	uint32_t i = from;
+
+	while(i < to) {
+		uint32_t chunk = i / FREE_CHUNK_SIZE;
+		uint32_t chunkEnd = (chunk + 1) * FREE_CHUNK_SIZE;
+		int count = freeChunkCount(This, chunk);
+
+		if(count < 0)
+			return i;
+		if(chunkEnd > to)
+			chunkEnd = to;
+		if(i % FREE_CHUNK_SIZE == 0 && count == FREE_CHUNK_SIZE) {
+			/* whole chunk free */
+			i = chunkEnd;
+			continue;
+		}
+		while(i < chunkEnd) {
+			unsigned long w = ~This->freeMap[i / BITS_PER_WORD] >>
+				(i % BITS_PER_WORD);
+			if(w) {
+				i += lowestBit(w);
+				return i < chunkEnd ? i : chunkEnd;
+			}
+			i = ROUND_DOWN(i, BITS_PER_WORD) + BITS_PER_WORD;
+		}
+		i = chunkEnd;
+	}
+	return to;
+}
+
+/*
+ * Pick the next cluster for a file whose current last cluster is
+ * prev (or 1 if the file is still empty), and which is projected to
+ * need nr more clusters.  The cluster directly following prev is
+ * preferred, so that the file stays contiguous.  Otherwise, a new
+ * extent is started at the first free run after the allocation
+ * pointer which holds all nr clusters (first fit, wrapping around),
+ * or failing that the biggest one.
+ * Returns 1 if no free cluster is left.
+ */
+unsigned int get_next_free_extent(Fs_t *This, unsigned int prev, uint32_t nr)
+{
+	uint32_t end = This->num_clus + 2;
+	uint32_t i, limit, first, start, runEnd, len;
+	uint32_t best, bestLen;
+	int wrapped;
+
+	if(prev >= 2 && prev + 1 < end) {
+		int r = freeChunkCount(This, (prev + 1) / FREE_CHUNK_SIZE);
+		if(r > 0 && (This->freeMap[(prev+1) / BITS_PER_WORD] &
+			     (1ul << ((prev+1) % BITS_PER_WORD)))) {
+			This->last = prev + 1;
+			return prev + 1;
+		}
+	}
+
+	first = get_next_free_cluster(This, prev);
+	if(nr <= 1 || first == 1)
+		return first;
+	if(nr > This->maxFreeRun)
+		/* an earlier search already came up short, and no
+		 * cluster got freed since */
+		return first;
+
+	best = first;
+	bestLen = 0;
+	i = first;
+	limit = end;
+	wrapped = 0;
+	while(1) {
+		start = findFreeCluster(This, i, limit);
+		if(start < 2) {
+			if(start == 1 || wrapped)
+				break;
+			/* wrap around, and stop again at first */
+			wrapped = 1;
+			limit = first;
+			i = 2;
+			continue;
+		}
+		runEnd = findRunEnd(This, start, end);
+		len = runEnd - start;
+		if(len > bestLen) {
+			best = start;
+			bestLen = len;
+			if(len >= nr)
+				break;
+		}
+		i = runEnd;
+	}
+	if(bestLen < nr)
+		This->maxFreeRun = bestLen;
+	This->last = best;
+	return best;
+}
+
 bool getSerialized(Fs_t *Fs) {
 	return Fs->serialized;
 }
@@ -921,17 +1492,17 @@ mt_off_t getfree(Stream_t *Dir)
 	DeclareThis(Fs_t);
 
 	if(This->freeSpace == MAX32 || This->freeSpace == 0) {
-		register unsigned int i;
+		uint32_t chunk;
 		uint32_t total;
 
 		total = 0L;
-		for (i = 2; i < This->num_clus + 2; i++) {
-			unsigned int r = fatDecode(This,i);
-			if(r == 1) {
+		for (chunk = 0; chunk * FREE_CHUNK_SIZE < This->num_clus + 2;
+		     chunk++) {
+			int r = freeChunkCount(This, chunk);
+			if(r < 0) {
 				return -1;
 			}
-			if (!r)
-				total++;
+			total += (uint32_t) r;
 		}
 		This->freeSpace = total;
 	}
@@ -947,7 +1518,7 @@ int getfreeMinClusters(Stream_t *Dir, uint32_t size)
 {
 	Stream_t *Stream = GetFs(Dir);
 	DeclareThis(Fs_t);
-	register unsigned int i, last;
+	uint32_t i, first, nrChunks;
 	size_t total;
 
 	if(batchmode && This->freeSpace == MAX32)
@@ -969,27 +1540,17 @@ int getfreeMinClusters(Stream_t *Dir, uint32_t size)
 	 * allocate the sectors.  That way, the same sectors of the FAT, which
 	 * are already loaded during getfreeMin will be able to be reused
 	 * during get_next_free_cluster */
-	last = This->last;
-
-	if ( last < 2 || last >= This->num_clus + 2)
-		last = 1;
-	for (i=last+1; i< This->num_clus+2; i++){
-		unsigned int r = fatDecode(This, i);
-		if(r == 1) {
-			goto exit_0;
-		}
-		if (!r)
-			total++;
-		if(total >= size)
-			return 1;
-	}
-	for(i=2; i < last+1; i++){
-		unsigned int r = fatDecode(This, i);
-		if(r == 1) {
+	first = This->last;
+	if ( first < 2 || first >= This->num_clus + 2)
+		first = 1;
+	first /= FREE_CHUNK_SIZE;
+	nrChunks = (This->num_clus + 2 + FREE_CHUNK_SIZE - 1) / FREE_CHUNK_SIZE;
+	for (i=0; i < nrChunks; i++){
+		int r = freeChunkCount(This, (first + i) % nrChunks);
+		if(r < 0) {
 			goto exit_0;
 		}
-		if (!r)
-			total++;
+		total += (size_t) r;
 		if(total >= size)
 			return 1;
 	}
@@ -1037,13 +1598,26 @@ int fs_free(Stream_t *Stream)
 
 	if(This->FatMap) {
 		int i, nr_entries;
+		if(mtools_lazy_fat_mirror)
+			fat_sync_mirrors(This);
 		nr_entries = (This->fat_len + SECT_PER_ENTRY - 1) /
 			SECT_PER_ENTRY;
-		for(i=0; i< nr_entries; i++)
-			if(This->FatMap[i].data)
-				free(This->FatMap[i].data);
+		if(This->fatBulk) {
+			/* all slots point into the bulk buffer */
+			free(This->fatBulk);
+			free(This->fatTable);
+		} else
+			for(i=0; i< nr_entries; i++)
+				if(This->FatMap[i].data)
+					free(This->FatMap[i].data);
 		free(This->FatMap);
 	}
+	if(This->freeMap) {
+		free(This->freeMap);
+		free(This->freeChunkCount);
+	}
+	if(This->freedRuns)
+		free(This->freedRuns);
 	if(This->cp)
 		cp_close(This->cp);
 	return 0;
@@ -0,0 +1,427 @@
+/*  Copyright 2026 The mtools contributors.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Scan raw FAT data for free entries.  For each free (zero) entry, a
+ * bit is set in a bitmap, and the number of free entries is
+ * returned.  The same pass looks for entries which are out of range.
+ * FAT16 and FAT32 are scanned 16 or 32 entries at a time using SSE2
+ * or AVX2 where the CPU supports it.
+ */
+
+#include "sysincludes.h"
+#include "msdos.h"
+#include "fat_scan.h"
+#ifdef HAVE_PTHREAD
+#include <pthread.h>
+#endif
+
+#if defined __GNUC__ && (defined __x86_64__ || defined __i386__) && \
+	defined HAVE_IMMINTRIN_H
+# define FAT_SCAN_X86
+# include <immintrin.h>
+#endif
+
+#define BITS_PER_WORD (sizeof(unsigned long)*8)
+#define FAT32_ADDR 0x0fffffff
+
+/* What counts as a bad entry */
+typedef struct scan_limits_t {
+	uint32_t first;		/* entries before this one are not checked */
+	uint32_t maxClus;	/* highest valid cluster number */
+	uint32_t lastFat;	/* lowest end of chain or bad cluster mark */
+} scan_limits_t;
+
+/* Kernels set *bad if they find a bad entry, and never clear it */
+typedef uint32_t (*scan_fn)(const unsigned char *fat, uint32_t nr,
+			    unsigned long *bitmap,
+			    const scan_limits_t *lim, int *bad);
+
+static inline unsigned int popcount(unsigned int m)
+{
+#ifdef __GNUC__
+	return (unsigned int) __builtin_popcount(m);
+#else
+	unsigned int n;
+	for(n=0; m; m &= m - 1)
+		n++;
+	return n;
+#endif
+}
+
+static inline void setFree(unsigned long *bitmap, uint32_t i)
+{
+	bitmap[i / BITS_PER_WORD] |= 1ul << (i % BITS_PER_WORD);
+}
+
+/* Store a mask of 16 or 32 entries, starting at a multiple of 16 */
+static inline uint32_t setMask(unsigned long *bitmap, uint32_t i,
+			       unsigned int m)
+{
+	bitmap[i / BITS_PER_WORD] |= (unsigned long) m << (i % BITS_PER_WORD);
+	return popcount(m);
+}
+
+/* Same test as fatDecode, for a non zero entry v at index i */
+static inline int isBad(const scan_limits_t *lim, uint32_t i, uint32_t v)
+{
+	return (v < 2 || v > lim->maxClus) && v < lim->lastFat &&
+		i >= lim->first;
+}
+
+/* Bad entry mask of a round of entries starting at i, ignoring those
+ * before lim->first */
+static inline unsigned int checkedMask(const scan_limits_t *lim, uint32_t i,
+				       unsigned int m)
+{
+	if(i < lim->first)
+		m &= ~0u << (lim->first - i);
+	return m;
+}
+
+/*
+ * Scalar versions
+ */
+
+static inline uint32_t scanEntry(unsigned long *bitmap, uint32_t i,
+				 uint32_t v, const scan_limits_t *lim,
+				 int *bad)
+{
+	if(!v) {
+		setFree(bitmap, i);
+		return 1;
+	}
+	if(isBad(lim, i, v))
+		*bad = 1;
+	return 0;
+}
+
+static uint32_t scan12(const unsigned char *p, uint32_t nr,
+		       unsigned long *bitmap, const scan_limits_t *lim,
+		       int *bad)
+{
+	uint32_t i, count = 0;
+
+	/* entries come in pairs packed into three bytes */
+	for(i=0; i < nr; i += 2, p += 3) {
+		count += scanEntry(bitmap, i,
+				   ((uint32_t) (p[1] & 0x0f) << 8) | p[0],
+				   lim, bad);
+		if(i + 1 < nr)
+			count += scanEntry(bitmap, i + 1,
+					   ((uint32_t) p[2] << 4) | (p[1] >> 4),
+					   lim, bad);
+	}
+	return count;
+}
+
+static uint32_t scan16(const unsigned char *p, uint32_t nr,
+		       unsigned long *bitmap, const scan_limits_t *lim,
+		       int *bad)
+{
+	uint32_t i, count = 0;
+
+	for(i=0; i < nr; i++, p += 2)
+		count += scanEntry(bitmap, i, WORD(p), lim, bad);
+	return count;
+}
+
+static uint32_t scan32(const unsigned char *p, uint32_t nr,
+		       unsigned long *bitmap, const scan_limits_t *lim,
+		       int *bad)
+{
+	uint32_t i, count = 0;
+
+	for(i=0; i < nr; i++, p += 4)
+		count += scanEntry(bitmap, i, DWORD(p) & FAT32_ADDR, lim, bad);
+	return count;
+}
+
+#ifdef FAT_SCAN_X86
+
+/*
+ * Vector versions.  There are only signed compares, so FAT16 entries
+ * are compared with their top bit flipped.  FAT32 entries have only
+ * 28 bits, and need no such trick.  An entry is bad if it is 1, or
+ * above maxClus but below lastFat.
+ */
+
+/*
+ * SSE2 versions, 16 entries per round
+ */
+
+__attribute__((target("sse2")))
+static inline __m128i bad16_sse2(__m128i v, __m128i one, __m128i flip,
+				 __m128i max, __m128i last)
+{
+	__m128i f = _mm_xor_si128(v, flip);
+	return _mm_or_si128(_mm_cmpeq_epi16(v, one),
+			    _mm_and_si128(_mm_cmpgt_epi16(f, max),
+					  _mm_cmpgt_epi16(last, f)));
+}
+
+__attribute__((target("sse2")))
+static uint32_t scan16_sse2(const unsigned char *p, uint32_t nr,
+			    unsigned long *bitmap, const scan_limits_t *lim,
+			    int *bad)
+{
+	uint32_t i, count = 0;
+	unsigned int badMask = 0;
+	__m128i zero = _mm_setzero_si128();
+	__m128i one = _mm_set1_epi16(1);
+	__m128i flip = _mm_set1_epi16((short) 0x8000);
+	__m128i max = _mm_set1_epi16((short) (lim->maxClus ^ 0x8000));
+	__m128i last = _mm_set1_epi16((short) (lim->lastFat ^ 0x8000));
+
+	for(i=0; i + 16 <= nr; i += 16, p += 32) {
+		__m128i a = _mm_loadu_si128((const __m128i *) p);
+		__m128i b = _mm_loadu_si128((const __m128i *) (p + 16));
+		__m128i ba = bad16_sse2(a, one, flip, max, last);
+		__m128i bb = bad16_sse2(b, one, flip, max, last);
+		badMask |= checkedMask(lim, i, (unsigned int)
+				       _mm_movemask_epi8(_mm_packs_epi16(ba,
+									 bb)));
+		a = _mm_cmpeq_epi16(a, zero);
+		b = _mm_cmpeq_epi16(b, zero);
+		count += setMask(bitmap, i, (unsigned int)
+				 _mm_movemask_epi8(_mm_packs_epi16(a, b)));
+	}
+	if(badMask)
+		*bad = 1;
+	return count;
+}
+
+__attribute__((target("sse2")))
+static uint32_t scan32_sse2(const unsigned char *p, uint32_t nr,
+			    unsigned long *bitmap, const scan_limits_t *lim,
+			    int *bad)
+{
+	uint32_t i, j, count = 0;
+	unsigned int badMask = 0;
+	__m128i zero = _mm_setzero_si128();
+	__m128i mask = _mm_set1_epi32(FAT32_ADDR);
+	__m128i one = _mm_set1_epi32(1);
+	__m128i max = _mm_set1_epi32((int) lim->maxClus);
+	__m128i last = _mm_set1_epi32((int) lim->lastFat);
+
+	for(i=0; i + 16 <= nr; i += 16, p += 64) {
+		unsigned int m = 0, bm = 0;
+		for(j=0; j < 4; j++) {
+			__m128i v = _mm_loadu_si128((const __m128i *)
+						    (p + 16 * j));
+			__m128i b;
+			v = _mm_and_si128(v, mask);
+			b = _mm_or_si128(_mm_cmpeq_epi32(v, one),
+					 _mm_and_si128(_mm_cmpgt_epi32(v, max),
+						       _mm_cmpgt_epi32(last,
+								       v)));
+			bm |= (unsigned int)
+				_mm_movemask_ps(_mm_castsi128_ps(b)) << (4 * j);
+			v = _mm_cmpeq_epi32(v, zero);
+			m |= (unsigned int)
+				_mm_movemask_ps(_mm_castsi128_ps(v)) << (4 * j);
+		}
+		badMask |= checkedMask(lim, i, bm);
+		count += setMask(bitmap, i, m);
+	}
+	if(badMask)
+		*bad = 1;
+	return count;
+}
+
+/*
+ * AVX2 versions, 32 entries per round
+ */
+
+__attribute__((target("avx2")))
+static inline __m256i bad16_avx2(__m256i v, __m256i one, __m256i flip,
+				 __m256i max, __m256i last)
+{
+	__m256i f = _mm256_xor_si256(v, flip);
+	return _mm256_or_si256(_mm256_cmpeq_epi16(v, one),
+			       _mm256_and_si256(_mm256_cmpgt_epi16(f, max),
+						_mm256_cmpgt_epi16(last, f)));
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan16_avx2(const unsigned char *p, uint32_t nr,
+			    unsigned long *bitmap, const scan_limits_t *lim,
+			    int *bad)
+{
+	uint32_t i, count = 0;
+	unsigned int badMask = 0;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i one = _mm256_set1_epi16(1);
+	__m256i flip = _mm256_set1_epi16((short) 0x8000);
+	__m256i max = _mm256_set1_epi16((short) (lim->maxClus ^ 0x8000));
+	__m256i last = _mm256_set1_epi16((short) (lim->lastFat ^ 0x8000));
+
+	for(i=0; i + 32 <= nr; i += 32, p += 64) {
+		__m256i a = _mm256_loadu_si256((const __m256i *) p);
+		__m256i b = _mm256_loadu_si256((const __m256i *) (p + 32));
+		__m256i packed;
+		/* packing works per 128 bit lane, restore entry order */
+		packed = _mm256_permute4x64_epi64(
+			_mm256_packs_epi16(bad16_avx2(a, one, flip, max, last),
+					   bad16_avx2(b, one, flip, max, last)),
+			0xd8);
+		badMask |= checkedMask(lim, i, (unsigned int)
+				       _mm256_movemask_epi8(packed));
+		a = _mm256_cmpeq_epi16(a, zero);
+		b = _mm256_cmpeq_epi16(b, zero);
+		packed = _mm256_permute4x64_epi64(_mm256_packs_epi16(a, b),
+						  0xd8);
+		count += setMask(bitmap, i,
+				 (unsigned int) _mm256_movemask_epi8(packed));
+	}
+	if(badMask)
+		*bad = 1;
+	return count;
+}
+
+__attribute__((target("avx2")))
+static uint32_t scan32_avx2(const unsigned char *p, uint32_t nr,
+			    unsigned long *bitmap, const scan_limits_t *lim,
+			    int *bad)
+{
+	uint32_t i, j, count = 0;
+	unsigned int badMask = 0;
+	__m256i zero = _mm256_setzero_si256();
+	__m256i mask = _mm256_set1_epi32(FAT32_ADDR);
+	__m256i one = _mm256_set1_epi32(1);
+	__m256i max = _mm256_set1_epi32((int) lim->maxClus);
+	__m256i last = _mm256_set1_epi32((int) lim->lastFat);
+
+	for(i=0; i + 32 <= nr; i += 32, p += 128) {
+		unsigned int m = 0, bm = 0;
+		for(j=0; j < 4; j++) {
+			__m256i v = _mm256_loadu_si256((const __m256i *)
+						       (p + 32 * j));
+			__m256i b;
+			v = _mm256_and_si256(v, mask);
+			b = _mm256_or_si256(
+				_mm256_cmpeq_epi32(v, one),
+				_mm256_and_si256(_mm256_cmpgt_epi32(v, max),
+						 _mm256_cmpgt_epi32(last, v)));
+			bm |= (unsigned int)
+				_mm256_movemask_ps(_mm256_castsi256_ps(b))
+				<< (8 * j);
+			v = _mm256_cmpeq_epi32(v, zero);
+			m |= (unsigned int)
+				_mm256_movemask_ps(_mm256_castsi256_ps(v))
+				<< (8 * j);
+		}
+		badMask |= checkedMask(lim, i, bm);
+		count += setMask(bitmap, i, m);
+	}
+	if(badMask)
+		*bad = 1;
+	return count;
+}
+
+#endif
+
+/*
+ * Vector kernels only handle whole rounds of 16 or 32 entries.  They
+ * are given a multiple of the bitmap word size, and the remainder is
+ * done by the scalar version.
+ */
+typedef struct scanner_t {
+	scan_fn vector;
+	scan_fn scalar;
+	unsigned int entrySize;
+} scanner_t;
+
+static scanner_t scanner16 = { 0, scan16, 2 };
+static scanner_t scanner32 = { 0, scan32, 4 };
+
+static void pick_scanners(void)
+{
+#ifdef FAT_SCAN_X86
+	__builtin_cpu_init();
+	if(__builtin_cpu_supports("avx2")) {
+		scanner16.vector = scan16_avx2;
+		scanner32.vector = scan32_avx2;
+	} else if(__builtin_cpu_supports("sse2")) {
+		scanner16.vector = scan16_sse2;
+		scanner32.vector = scan32_sse2;
+	}
+#endif
+}
+
+/* May be called from several threads at once */
+static void init_scanners(void)
+{
+#ifdef HAVE_PTHREAD
+	static pthread_once_t once = PTHREAD_ONCE_INIT;
+
+	pthread_once(&once, pick_scanners);
+#else
+	static int initialized = 0;
+
+	if(initialized)
+		return;
+	initialized = 1;
+	pick_scanners();
+#endif
+}
+
+int fat_scan_chunk(const unsigned char *fat, unsigned int fat_bits,
+		   uint32_t start, uint32_t nr,
+		   uint32_t maxClus, uint32_t lastFat,
+		   unsigned long *bitmap)
+{
+	scanner_t *s;
+	scan_limits_t lim;
+	uint32_t done, count;
+	int bad = 0;
+
+	/* entries 0 and 1 do not describe clusters */
+	lim.first = start < 2 ? 2 - start : 0;
+	lim.maxClus = maxClus;
+	lim.lastFat = lastFat;
+
+	if(fat_bits == 12)
+		count = scan12(fat, nr, bitmap, &lim, &bad);
+	else {
+		init_scanners();
+		s = fat_bits == 16 ? &scanner16 : &scanner32;
+		count = 0;
+		done = 0;
+		if(s->vector) {
+			done = nr - nr % BITS_PER_WORD;
+			count = s->vector(fat, done, bitmap, &lim, &bad);
+		}
+		if(done < nr) {
+			lim.first = lim.first > done ? lim.first - done : 0;
+			count += s->scalar(fat + done * s->entrySize,
+					   nr - done,
+					   bitmap + done / BITS_PER_WORD,
+					   &lim, &bad);
+		}
+	}
+
+	if(bad) {
+		memset(bitmap, 0, (nr + BITS_PER_WORD - 1) / BITS_PER_WORD *
+		       sizeof(unsigned long));
+		return -1;
+	}
+	if(start < 2) {
+		unsigned int low = (unsigned int) (*bitmap & 3ul);
+		count -= (low & 1) + (low >> 1);
+		*bitmap &= ~3ul;
+	}
+	return (int) count;
+}
@@ -0,0 +1,32 @@
+#ifndef MTOOLS_FAT_SCAN_H
+#define MTOOLS_FAT_SCAN_H
+
+/*  Copyright 2026 The mtools contributors.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+/* Fill in bitmap, which starts at entry start, for the nr raw FAT
+ * entries at fat, and return how many of them are free clusters.
+ * Entries 0 and 1 never are.  Returns -1, leaving bitmap clear, if an
+ * entry is neither free, nor a cluster number up to maxClus, nor an
+ * end or bad cluster mark at or above lastFat.  For FAT12, start must
+ * be even, and for all of them a multiple of the bitmap word size */
+int fat_scan_chunk(const unsigned char *fat, unsigned int fat_bits,
+		   uint32_t start, uint32_t nr,
+		   uint32_t maxClus, uint32_t lastFat,
+		   unsigned long *bitmap);
+
+#endif
@@ -0,0 +1,191 @@
+/*  Copyright 2026 The mtools contributors.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Timing driver for the free cluster scan.  Fills a FAT with random
+ * valid entries, about one in eight of them free, and fills in the
+ * free cluster bitmap chunk by chunk, as freeChunkCount does: once
+ * with a per entry loop doing the range check of fatDecode (what it
+ * does when the raw FAT is not available), and once with
+ * fat_scan_chunk.  Not built by default, use "make fat_scan_bench".
+ *
+ * Usage: fat_scan_bench [fat_bits [entries [rounds]]]
+ */
+
+#include "sysincludes.h"
+#include "msdos.h"
+#include "fat_scan.h"
+
+#define CHUNK 4096
+#define BITS_PER_WORD (sizeof(unsigned long)*8)
+
+static unsigned int decode(const unsigned char *fat, unsigned int fat_bits,
+			   uint32_t i)
+{
+	const unsigned char *p;
+
+	switch(fat_bits) {
+	case 12:
+		p = fat + i * 3 / 2;
+		if(i & 1)
+			return ((unsigned int) p[1] << 4) | (p[0] >> 4);
+		else
+			return ((unsigned int) (p[1] & 0xf) << 8) | p[0];
+	case 16:
+		return WORD(fat + i * 2);
+	default:
+		return DWORD(fat + i * 4) & 0x0fffffff;
+	}
+}
+
+static void encode(unsigned char *fat, unsigned int fat_bits,
+		   uint32_t i, unsigned int v)
+{
+	unsigned char *p;
+
+	switch(fat_bits) {
+	case 12:
+		p = fat + i * 3 / 2;
+		if(i & 1) {
+			p[0] = (unsigned char) ((p[0] & 0x0f) | (v << 4));
+			p[1] = (unsigned char) (v >> 4);
+		} else {
+			p[0] = (unsigned char) v;
+			p[1] = (unsigned char) ((p[1] & 0xf0) | (v >> 8));
+		}
+		break;
+	case 16:
+		set_word(fat + i * 2, (uint16_t) v);
+		break;
+	default:
+		set_dword(fat + i * 4, v);
+		break;
+	}
+}
+
+static int loopScan(const unsigned char *fat, unsigned int fat_bits,
+		    uint32_t start, uint32_t nr,
+		    uint32_t maxClus, uint32_t lastFat,
+		    unsigned long *bitmap)
+{
+	uint32_t i, count = 0;
+
+	for(i=start < 2 ? 2 - start : 0; i < nr; i++) {
+		unsigned int v = decode(fat, fat_bits, i);
+		if(!v) {
+			bitmap[i / BITS_PER_WORD] |= 1ul << (i % BITS_PER_WORD);
+			count++;
+		} else if((v < 2 || v > maxClus) && v < lastFat)
+			return -1;
+	}
+	return (int) count;
+}
+
+static double now(void)
+{
+	return (double) clock() / CLOCKS_PER_SEC;
+}
+
+int main(int argc, char **argv)
+{
+	unsigned int fat_bits = 32;
+	uint32_t nr = 0;
+	unsigned int rounds = 0, r;
+	uint32_t i, j, len, maxClus, lastFat;
+	int count[2], r0;
+	unsigned char *fat;
+	unsigned long *bitmap[2];
+	size_t words;
+	double t[2];
+	int k;
+
+	if(argc > 1)
+		fat_bits = (unsigned int) strtoul(argv[1], 0, 0);
+	if(argc > 2)
+		nr = (uint32_t) strtoul(argv[2], 0, 0);
+	if(argc > 3)
+		rounds = (unsigned int) strtoul(argv[3], 0, 0);
+	if(fat_bits != 12 && fat_bits != 16 && fat_bits != 32) {
+		fprintf(stderr,
+			"Usage: %s [12|16|32 [entries [rounds]]]\n", argv[0]);
+		return 1;
+	}
+	lastFat = fat_bits == 12 ? 0xff6 : fat_bits == 16 ? 0xfff6 : 0xffffff6;
+	if(!nr)
+		/* as big as this FAT type allows, up to 4M */
+		nr = lastFat - 1 < (1u << 22) ? lastFat - 1 : 1u << 22;
+	if(!rounds)
+		/* about 80M entries in total */
+		rounds = (80u << 20) / nr;
+	if(nr < 3 || nr > lastFat - 1) {
+		fprintf(stderr, "Between 3 and %u entries for FAT%u\n",
+			lastFat - 1, fat_bits);
+		return 1;
+	}
+
+	fat = calloc((size_t) nr * fat_bits / 8 + 4, 1);
+	words = (nr + BITS_PER_WORD - 1) / BITS_PER_WORD;
+	bitmap[0] = calloc(words, sizeof(unsigned long));
+	bitmap[1] = calloc(words, sizeof(unsigned long));
+	if(!fat || !bitmap[0] || !bitmap[1]) {
+		perror("calloc");
+		return 1;
+	}
+	maxClus = nr - 1;
+	srandom(1);
+	for(i=0; i < nr; i++)
+		encode(fat, fat_bits, i,
+		       random() % 8 ? 2 + (unsigned int) random() % (nr - 2)
+		       : 0);
+
+	for(k=0; k < 2; k++) {
+		t[k] = now();
+		for(r=0; r < rounds; r++) {
+			memset(bitmap[k], 0, words * sizeof(unsigned long));
+			count[k] = 0;
+			for(j=0; j < nr; j += CHUNK) {
+				const unsigned char *p =
+					fat + (size_t) j * fat_bits / 8;
+				unsigned long *w = bitmap[k] + j / BITS_PER_WORD;
+				len = nr - j < CHUNK ? nr - j : CHUNK;
+				if(k)
+					r0 = fat_scan_chunk(p, fat_bits, j, len,
+							    maxClus, lastFat, w);
+				else
+					r0 = loopScan(p, fat_bits, j, len,
+						      maxClus, lastFat, w);
+				if(r0 < 0) {
+					fprintf(stderr, "Bad entry found\n");
+					return 1;
+				}
+				count[k] += r0;
+			}
+		}
+		t[k] = now() - t[k];
+	}
+
+	if(count[0] != count[1] ||
+	   memcmp(bitmap[0], bitmap[1], words * sizeof(unsigned long))) {
+		fprintf(stderr,
+			"Mismatch: %d free entries with loop, %d with scan\n",
+			count[0], count[1]);
+		return 1;
+	}
+	printf("FAT%u, %u entries, %d free, %u rounds\n",
+	       fat_bits, nr, count[0], rounds);
+	printf("per entry loop: %8.4fs\n", t[0]);
+	printf("fat_scan_chunk: %8.4fs\n", t[1]);
+	return 0;
+}
@@ -23,6 +23,14 @@
 #include "htable.h"
 #include "dirCache.h"
 #include "buffer.h"
+#include "plain_io.h"
+
+/* A run of contiguous clusters of a file */
+typedef struct Extent_t {
+	uint32_t rel; /* position of first cluster, relative to file */
+	uint32_t abs; /* absolute cluster number of first cluster */
+	uint32_t len; /* number of clusters in run */
+} Extent_t;
 
 typedef struct File_t {
 	struct Stream_t head;
@@ -57,6 +65,14 @@ typedef struct File_t {
 	unsigned int loopDetectRel;
 	unsigned int loopDetectAbs;
 
+	/* Part of cluster chain which has already been walked, as a
+	 * sorted list of runs */
+	Extent_t *extents;
+	unsigned int nrExtents;
+	unsigned int extentsAllocated;
+	uint32_t extentClusters; /* number of clusters covered */
+	int chainKnown; /* extents cover the whole file */
+
 	uint32_t where;
 } File_t;
 
@@ -90,6 +106,16 @@ direntry_t *getDirentry(Stream_t *Stream)
 	return &getUnbufferedFile(Stream)->direntry;
 }
 
+/* Cluster size in bytes, if Stream is a file (or a filter on top of
+ * one) on a DOS filesystem.  0 otherwise */
+size_t getFileClusterBytes(Stream_t *Stream)
+{
+	for(; Stream; Stream = Stream->Next)
+		if(Stream->Class == &FileClass)
+			return getClusterBytes(_getFs((File_t *) Stream));
+	return 0;
+}
+
 /**
  * Overflow-safe conversion of bytes to cluster
  */
@@ -136,6 +162,24 @@ static int recalcPreallocSize(File_t *This)
 	return 0;
 }
 
+/*
+ * How many more clusters a file which already has allocated clusters
+ * is projected to need, if it is written until end
+ */
+static uint32_t clustersToAllocate(File_t *This, uint32_t allocated,
+				   uint32_t end)
+{
+	Fs_t *Fs = _getFs(This);
+	uint32_t needed;
+
+	if(end < This->preallocatedSize)
+		end = This->preallocatedSize;
+	needed = filebytesToClusters(end, Fs->cluster_size * Fs->sector_size);
+	if(needed <= allocated)
+		return 1;
+	return needed - allocated;
+}
+
 static int _loopDetect(unsigned int *oldrel, unsigned int rel,
 		       unsigned int *oldabs, unsigned int absol)
 {
@@ -267,6 +311,131 @@ void printFatWithOffset(Stream_t *Stream, off_t offset) {
 	printf("%lu", (unsigned long) n);
 }
 
+/*
+ * Remember that relative cluster rel of the file is at absolute
+ * position absol.  Only extends the known part of the chain
+ */
+static void extentRecord(File_t *This, uint32_t rel, uint32_t absol)
+{
+	Extent_t *last;
+
+	if(rel != This->extentClusters)
+		return;
+
+	if(This->nrExtents) {
+		last = &This->extents[This->nrExtents-1];
+		if(absol == last->abs + last->len) {
+			last->len++;
+			This->extentClusters++;
+			return;
+		}
+	}
+
+	if(This->nrExtents == This->extentsAllocated) {
+		unsigned int n = This->extentsAllocated ?
+			This->extentsAllocated * 2 : 8;
+		Extent_t *e = realloc(This->extents, n * sizeof(Extent_t));
+		if(!e)
+			/* not fatal, we just don't remember */
+			return;
+		This->extents = e;
+		This->extentsAllocated = n;
+	}
+	last = &This->extents[This->nrExtents++];
+	last->rel = rel;
+	last->abs = absol;
+	last->len = 1;
+	This->extentClusters++;
+}
+
+/*
+ * Find the known position in the chain closest to (and not after)
+ * relative cluster rel
+ */
+static Extent_t *extentLookup(File_t *This, uint32_t rel,
+			      uint32_t *CurCluNr, uint32_t *AbsCluNr)
+{
+	unsigned int lo, hi;
+	Extent_t *e;
+
+	if(!This->nrExtents) {
+		*CurCluNr = 0;
+		*AbsCluNr = This->FirstAbsCluNr;
+		return NULL;
+	}
+
+	/* last extent starting at or before rel */
+	lo = 0;
+	hi = This->nrExtents;
+	while(hi - lo > 1) {
+		unsigned int mid = (lo + hi) / 2;
+		if(This->extents[mid].rel <= rel)
+			lo = mid;
+		else
+			hi = mid;
+	}
+	e = &This->extents[lo];
+	if(rel >= e->rel + e->len)
+		rel = e->rel + e->len - 1;
+	*CurCluNr = rel;
+	*AbsCluNr = e->abs + (rel - e->rel);
+	return e;
+}
+
+/*
+ * Walk the whole cluster chain of a file up front, so that reads can
+ * be served from the extent list without going back to the FAT
+ */
+static void prefetchChain(File_t *This)
+{
+	Fs_t *Fs = _getFs(This);
+	uint32_t clus_size = Fs->cluster_size * Fs->sector_size;
+	uint32_t nrClu = filebytesToClusters(This->FileSize, clus_size);
+	uint32_t rel, absol;
+
+	if(This->chainKnown || This->FirstAbsCluNr < 2 || !nrClu)
+		return;
+
+	absol = This->FirstAbsCluNr;
+	for(rel = 0; ; rel++) {
+		if(absol < 2 || absol > Fs->num_clus + 1)
+			/* bad chain, leave it to normal_map to complain */
+			return;
+		extentRecord(This, rel, absol);
+		if(This->extentClusters != rel + 1)
+			/* out of memory */
+			return;
+		if(rel + 1 == nrClu)
+			break;
+		absol = fatDecode(Fs, absol);
+		if(loopDetect(This, rel + 1, absol) < 0)
+			return;
+	}
+	This->chainKnown = 1;
+}
+
+/*
+ * If relative cluster RelCluNr is in a known extent which can't grow
+ * any more, map directly from that extent.  Returns 1 if successful
+ */
+static int extentMap(File_t *This, uint32_t RelCluNr, uint32_t offset,
+		     uint32_t *len, uint32_t clus_size)
+{
+	Extent_t *e;
+	uint32_t CurCluNr, AbsCluNr;
+
+	if(RelCluNr >= This->extentClusters)
+		return 0;
+	e = extentLookup(This, RelCluNr, &CurCluNr, &AbsCluNr);
+	if(!This->chainKnown && e == &This->extents[This->nrExtents-1])
+		/* last extent might continue beyond what is known */
+		return 0;
+	maximize(*len, (e->rel + e->len - RelCluNr) * clus_size - offset);
+	This->PreviousRelCluNr = RelCluNr;
+	This->PreviousAbsCluNr = AbsCluNr;
+	return 1;
+}
+
 static int normal_map(File_t *This, uint32_t where, uint32_t *len,
 		      int isReadonly, mt_off_t *res)
 {
@@ -294,7 +463,9 @@ static int normal_map(File_t *This, uint32_t where, uint32_t *len,
 			*len = 0;
 			return 0;
 		}
-		NewCluNr = get_next_free_cluster(_getFs(This), 1);
+		NewCluNr = get_next_free_extent(_getFs(This), 1,
+						clustersToAllocate(This, 0,
+								   where + *len));
 		if (NewCluNr == 1 ){
 			errno = ENOSPC;
 			return -2;
@@ -307,13 +478,12 @@ static int normal_map(File_t *This, uint32_t where, uint32_t *len,
 
 	RelCluNr = where / clus_size;
 
-	if (RelCluNr >= This->PreviousRelCluNr){
-		CurCluNr = This->PreviousRelCluNr;
-		AbsCluNr = This->PreviousAbsCluNr;
-	} else {
-		CurCluNr = 0;
-		AbsCluNr = This->FirstAbsCluNr;
-	}
+	if(extentMap(This, RelCluNr, offset, len, clus_size))
+		goto mapped;
+
+	if(!This->nrExtents)
+		extentRecord(This, 0, This->FirstAbsCluNr);
+	extentLookup(This, RelCluNr, &CurCluNr, &AbsCluNr);
 
 
 	NrClu = (offset + *len - 1) / clus_size;
@@ -334,7 +504,10 @@ static int normal_map(File_t *This, uint32_t where, uint32_t *len,
 			break;
 		if (NewCluNr > Fs->last_fat && !isReadonly){
 			/* if at end, and writing, extend it */
-			NewCluNr = get_next_free_cluster(_getFs(This), AbsCluNr);
+			NewCluNr = get_next_free_extent(_getFs(This), AbsCluNr,
+							clustersToAllocate(This,
+									   CurCluNr+1,
+									   where + *len));
 			if (NewCluNr == 1 ){ /* no more space */
 				errno = ENOSPC;
 				return -2;
@@ -355,10 +528,13 @@ static int normal_map(File_t *This, uint32_t where, uint32_t *len,
 			errno = EIO;
 			return -2;
 		}
+		if(AbsCluNr >= 2 && AbsCluNr <= Fs->num_clus + 1)
+			extentRecord(This, CurCluNr, AbsCluNr);
 	}
 
 	maximize(*len, (1 + CurCluNr - RelCluNr) * clus_size - offset);
 
+ mapped:
 	end = where + *len;
 	if(batchmode &&
 	   !isReadonly &&
@@ -422,6 +598,41 @@ static ssize_t read_file(Stream_t *Stream, char *buf, size_t ilen)
 	return ret;
 }
 
+/*
+ * Copy up to len bytes of Source, from its current position, to
+ * Target inside the kernel, if the run of clusters at that position
+ * can be read through a plain file descriptor and Target is a plain
+ * file.  Returns -2 if not possible; the caller then falls back to
+ * read_file
+ */
+ssize_t copyFileDirect(Stream_t *Source, Stream_t *Target, size_t len)
+{
+	File_t *This;
+	mt_off_t pos;
+	uint32_t rlen = truncSizeTo32u(len);
+	int fd;
+	int err;
+	ssize_t ret;
+
+	if(Source->Class != &FileClass)
+		/* filtered, e.g. by open_dos2unix */
+		return -2;
+	if(!can_copy_from_fd(Target))
+		/* before get_raw_fd, which flushes the buffer cache */
+		return -2;
+	This = (File_t *) Source;
+	err = This->map(This, This->where, &rlen, 1, &pos);
+	if(err <= 0)
+		return err;
+	fd = get_raw_fd(_getFs(This)->head.Next, &pos);
+	if(fd < 0)
+		return -2;
+	ret = copy_from_fd(Target, fd, pos, rlen);
+	if(ret > 0)
+		This->where += (uint32_t) ret;
+	return ret;
+}
+
 static ssize_t write_file(Stream_t *Stream, char *buf, size_t ilen)
 {
 	DeclareThis(File_t);
@@ -566,6 +777,9 @@ static int free_file(Stream_t *Stream)
 	fsReleasePreallocateClusters(Fs, This->preallocatedClusters);
 	FREE(&This->direntry.Dir);
 	freeDirCache(Stream);
+	/* after freeDirCache, which may still write through the file */
+	if(This->extents)
+		free(This->extents);
 	return hash_remove(filehash, (void *) Stream, This->hint);
 }
 
@@ -613,7 +827,8 @@ static Class_t FileClass = {
 	get_file_data,
 	pre_allocate_file,
 	get_dosConvert_pass_through,
-	0 /* discard */
+	0, /* discard */
+	0 /* get_raw_fd */
 };
 
 static unsigned int getAbsCluNr(File_t *This)
@@ -719,6 +934,12 @@ static Stream_t *_internalFileOpen(Stream_t *Dir, unsigned int first,
 	File->loopDetectRel = 0;
 	File->loopDetectAbs = 0;
 
+	File->extents = NULL;
+	File->nrExtents = 0;
+	File->extentsAllocated = 0;
+	File->extentClusters = 0;
+	File->chainKnown = 0;
+
 	File->PreviousRelCluNr = 0xffff;
 	File->FileSize = size;
 	hash_add(filehash, File, &File->hint);
@@ -798,7 +1019,8 @@ Stream_t *OpenFileByDirentry(direntry_t *entry)
 		bufferize(&file);
 		if(first == 1)
 			dir_grow(file, 0);
-	}
+	} else if(mtools_prefetch_chain)
+		prefetchChain((File_t *) file);
 
 	return file;
 }
@@ -25,4 +25,6 @@ Stream_t *OpenRoot(Stream_t *Dir);
 void printFat(Stream_t *Stream);
 void printFatWithOffset(Stream_t *Stream, off_t offset);
 direntry_t *getDirentry(Stream_t *Stream);
+size_t getFileClusterBytes(Stream_t *Stream);
+ssize_t copyFileDirect(Stream_t *Source, Stream_t *Target, size_t len);
 #endif
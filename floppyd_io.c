@@ -442,7 +442,8 @@ static Class_t FloppydFileClass = {
 	floppyd_data,
 	0, /* pre_allocate */
 	0, /* get_dosConvert */
-	0  /* discard */
+	0, /* discard */
+	0  /* get_raw_fd */
 };
 
 /* ######################################################################## */
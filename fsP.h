@@ -20,6 +20,12 @@
 #include "stream.h"
 #include "msdos.h"
 
+/* Run of clusters freed since the FAT was last written */
+typedef struct FreedRun_t {
+	uint32_t start;
+	uint32_t len;
+} FreedRun_t;
+
 typedef enum fatAccessMode_t {
 	FAT_ACCESS_READ,
 	FAT_ACCESS_WRITE
@@ -52,6 +58,14 @@ struct Fs_t {
 
 	struct FatMap_t *FatMap;
 
+	/* Whole FAT loaded in one go (MTOOLS_FAT_BULK_LOAD) */
+	unsigned char *fatBulk; /* contiguous copy of the primary FAT */
+	uint32_t *fatTable; /* decoded FAT entries */
+	uint32_t fatTableLen; /* number of entries in fatTable */
+	unsigned int (*raw_fat_decode)(struct Fs_t *This, unsigned int num);
+	void (*raw_fat_encode)(struct Fs_t *This, unsigned int num,
+			       unsigned int code);
+
 	uint32_t dir_start;
 	uint16_t dir_len;
 	uint32_t clus_start;
@@ -69,6 +83,22 @@ struct Fs_t {
 	uint32_t freeSpace; /* free space, or MAX32 if unknown */
 	unsigned int preallocatedClusters;
 
+	/* Free cluster bitmap (one bit per cluster, set if free), and
+	 * number of free clusters per chunk of the bitmap.  Chunks are
+	 * filled in from the FAT on first use */
+	unsigned long *freeMap;
+	uint32_t *freeChunkCount;
+	uint32_t nrFreeChunks;
+	/* upper bound for the longest free run, or MAX32 if unknown.
+	 * Only valid while no cluster gets freed */
+	uint32_t maxFreeRun;
+
+	/* Clusters to punch out of a sparse image (MTOOLS_SPARSE_IMAGE)
+	 * once the FAT no longer refers to them */
+	FreedRun_t *freedRuns;
+	uint32_t nrFreedRuns;
+	uint32_t freedRunsAllocated;
+
 	uint32_t lastFatSectorNr;
 	unsigned char *lastFatSectorData;
 	fatAccessMode_t lastFatAccessMode;
@@ -90,6 +120,7 @@ int fs_free(Stream_t *Stream);
 
 void set_fat(Fs_t *This,bool haveBigFatLen);
 unsigned int get_next_free_cluster(Fs_t *Fs, unsigned int last);
+unsigned int get_next_free_extent(Fs_t *Fs, unsigned int prev, uint32_t nr);
 unsigned int fatDecode(Fs_t *This, unsigned int pos);
 void fatAppend(Fs_t *This, unsigned int pos, unsigned int newpos);
 void fatDeallocate(Fs_t *This, unsigned int pos);
@@ -90,7 +90,8 @@ Class_t FsClass = {
 	get_data_pass_through,
 	0, /* pre allocate */
 	get_dosConvert, /* dosconvert */
-	0 /* discard */
+	0, /* discard */
+	0 /* get_raw_fd */
 };
 
 /**
@@ -568,7 +569,8 @@ Stream_t *fs_init(char drive, int mode, int *isRop)
 		blocksize = dev.blocksize;
 	if (disk_size) {
 		Stream_t *Buffer = buf_init(This->head.Next,
-					    disk_size * blocksize,
+					    buf_cache_size(disk_size * blocksize,
+							   disk_size * blocksize),
 					    disk_size * blocksize,
 					    This->sector_size);
 
@@ -253,5 +253,5 @@ void mattrib(int argc, char **argv, int type UNUSEDP)
 	mp.lookupflags = ACCEPT_PLAIN | ACCEPT_DIR;
 	if(arg.recursive)
 		mp.lookupflags |= DO_OPEN_DIRS | NO_DOTS;
-	exit(main_loop(&mp, argv + optind, argc - optind));
+	exit(close_drives(main_loop(&mp, argv + optind, argc - optind)));
 }
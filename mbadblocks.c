@@ -276,5 +276,5 @@ void mbadblocks(int argc, char **argv, int type UNUSEDP)
 	}
  exit_0:
 	FREE(&Dir);
-	exit(ret);
+	exit(close_drives(ret));
 }
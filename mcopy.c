@@ -424,7 +424,15 @@ static int writeit(struct dos_name_t *dosname,
 	if (arg->needfilter & arg->textmode) {
 		Source = open_unix2dos(Source,arg->convertCharset);
 	}
-		
+
+	/* let the allocator look for an extent big enough for the
+	 * whole file */
+	if(filesize && PRE_ALLOCATE(Target, filesize) < 0) {
+		FREE(&Source);
+		FREE(&Target);
+		return -1;
+	}
+
 	ret = copyfile(Source, Target);
 	GET_DATA(Target, 0, 0, 0, &fat);
 	FREE(&Source);
@@ -716,5 +724,5 @@ void mcopy(int argc, char **argv, int mtype)
 		}
 	}
 
-	exit(main_loop(&arg.mp, argv + optind, argc - optind));
+	exit(close_drives(main_loop(&arg.mp, argv + optind, argc - optind)));
 }
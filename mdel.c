@@ -205,5 +205,5 @@ void mdel(int argc, char **argv, int deltype)
 			argv[i][b+l-1] = '\0';
 	}
 
-	exit(main_loop(&mp, argv + optind, argc - optind));
+	exit(close_drives(main_loop(&mp, argv + optind, argc - optind)));
 }
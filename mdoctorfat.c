@@ -166,10 +166,10 @@ void mdoctorfat(int argc, char **argv, int mtype UNUSEDP)
 
 		for (j=begin; j <= end; j++) {
 			if(arg.markbad) {
-				arg.Fs->fat_encode(arg.Fs, j+offset, arg.Fs->last_fat ^ 6 ^ 8);
+				fatEncode(arg.Fs, j+offset, arg.Fs->last_fat ^ 6 ^ 8);
 			} else {
 				if(address) {
-					arg.Fs->fat_encode(arg.Fs, address, j+offset);
+					fatEncode(arg.Fs, address, j+offset);
 				}
 				address = j+offset;
 			}
@@ -177,8 +177,8 @@ void mdoctorfat(int argc, char **argv, int mtype UNUSEDP)
 	}
 
 	if (address && !arg.markbad) {
-		arg.Fs->fat_encode(arg.Fs, address, arg.Fs->end_fat);
+		fatEncode(arg.Fs, address, arg.Fs->end_fat);
 	}
 
-	exit(ret);
+	exit(close_drives(ret));
 }
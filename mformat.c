@@ -37,6 +37,7 @@
 #include "open_image.h"
 #include "file_name.h"
 #include "lba.h"
+#include "uring_io.h"
 
 #ifdef OS_linux
 #include "linux/hdreg.h"
@@ -1293,7 +1294,10 @@ void mformat(int argc, char **argv, int dummy UNUSEDP)
 		memset(boot.characters, '\0', Fs->sector_size);
 
 	Fs->head.Next = buf_init(Fs->head.Next,
-				 blocksize * used_dev.heads * used_dev.sectors,
+				 buf_cache_size(blocksize * used_dev.heads *
+						used_dev.sectors,
+						blocksize * used_dev.heads *
+						used_dev.sectors),
 				 blocksize * used_dev.heads * used_dev.sectors,
 				 blocksize);
 
@@ -1456,7 +1460,10 @@ void mformat(int argc, char **argv, int dummy UNUSEDP)
 		}
 	}
 
-	FREE((Stream_t **)&Fs);
+	if(uring_close((Stream_t **)&Fs) < 0) {
+		fprintf(stderr, "Error writing to drive %c:\n", drive);
+		exit(1);
+	}
 #ifdef USE_XDF
 	if(format_xdf && isatty(0) && !getenv("MTOOLS_USE_XDF"))
 		fprintf(stderr,
@@ -327,5 +327,5 @@ void mlabel(int argc, char **argv, int type UNUSEDP)
 	}
 
 	FREE(&RootDir);
-	exit(result);
+	exit(close_drives(result));
 }
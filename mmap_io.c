@@ -0,0 +1,127 @@
+/*  Copyright 2026 The mtools contributors.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Read regular image files through a shared memory mapping.  Writes,
+ * and reads beyond the size the file had when it was mapped, are
+ * passed on to the underlying plain file.  Writes are not done through
+ * the mapping because storing into a page which needs new blocks
+ * (a hole of a sparse image, or any block on copy on write file
+ * systems) raises SIGBUS instead of failing with ENOSPC when the
+ * file system is full.
+ */
+
+#include "sysincludes.h"
+#include "mtools.h"
+#include "plain_io.h"
+#include "mmap_io.h"
+
+#if defined HAVE_MMAP && defined HAVE_SYS_MMAN_H
+#include <sys/mman.h>
+
+typedef struct Mmap_t {
+	struct Stream_t head;
+
+	char *map;
+	size_t size;
+} Mmap_t;
+
+static ssize_t mmap_pread(Stream_t *Stream, char *buf,
+			  mt_off_t start, size_t len)
+{
+	DeclareThis(Mmap_t);
+
+	if(start >= (mt_off_t) This->size)
+		return PREADS(This->head.Next, buf, start, len);
+	maximize(len, This->size - (size_t) start);
+	memcpy(buf, This->map + start, len);
+	return (ssize_t) len;
+}
+
+static ssize_t mmap_pwrite(Stream_t *Stream, char *buf,
+			   mt_off_t start, size_t len)
+{
+	DeclareThis(Mmap_t);
+
+	/* the mapping is shared, so it sees this write */
+	return PWRITES(This->head.Next, buf, start, len);
+}
+
+static int mmap_free(Stream_t *Stream)
+{
+	DeclareThis(Mmap_t);
+
+	return munmap(This->map, This->size);
+}
+
+static int mmap_discard(Stream_t *Stream)
+{
+	DeclareThis(Mmap_t);
+
+	if(This->head.Next->Class->discard)
+		return DISCARD(This->head.Next);
+	return 0;
+}
+
+static Class_t MmapClass = {
+	0,
+	0,
+	mmap_pread,
+	mmap_pwrite,
+	0,
+	mmap_free,
+	set_geom_pass_through, /* set_geom */
+	get_data_pass_through, /* get_data */
+	0, /* pre-allocate */
+	get_dosConvert_pass_through, /* dos convert */
+	mmap_discard, /* discard */
+	get_raw_fd_pass_through, /* get_raw_fd */
+};
+
+Stream_t *OpenMmap(Stream_t *Next)
+{
+	Mmap_t *This;
+	struct MT_STAT statbuf;
+	int fd;
+	void *map;
+
+	fd = get_fd(Next);
+	if(fd < 0 || MT_FSTAT(fd, &statbuf) < 0 ||
+	   !S_ISREG(statbuf.st_mode) || statbuf.st_size <= 0 ||
+	   (mt_off_t) (size_t) statbuf.st_size != statbuf.st_size)
+		return NULL;
+
+	This = New(Mmap_t);
+	if (!This)
+		return NULL;
+	This->size = (size_t) statbuf.st_size;
+	map = mmap(NULL, This->size, PROT_READ, MAP_SHARED, fd, 0);
+	if(map == MAP_FAILED) {
+		Free(This);
+		return NULL;
+	}
+	This->map = map;
+	init_head(&This->head, &MmapClass, Next);
+	return &This->head;
+}
+
+#else
+
+Stream_t *OpenMmap(Stream_t *Next UNUSEDP)
+{
+	return NULL;
+}
+
+#endif
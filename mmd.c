@@ -191,5 +191,5 @@ void mmd(int argc, char **argv, int type UNUSEDP)
 	arg.mp.openflags = O_RDWR;
 	arg.mp.callback = createDirCallback;
 	arg.mp.lookupflags = OPEN_PARENT | DO_OPEN_DIRS;
-	exit(main_loop(&arg.mp, argv + optind, argc - optind));
+	exit(close_drives(main_loop(&arg.mp, argv + optind, argc - optind)));
 }
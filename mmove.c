@@ -317,5 +317,5 @@ void mmove(int argc, char **argv, int oldsyntax)
 	arg.mp.shortname.len = sizeof(shortname);
 	shortname[0]='\0';
 
-	exit(main_loop(&arg.mp, argv + optind, argc - optind - 1));
+	exit(close_drives(main_loop(&arg.mp, argv + optind, argc - optind - 1)));
 }
@@ -72,5 +72,5 @@ void mshortname(int argc, char **argv, int type UNUSEDP)
 	mp.callback = print_short_name;
 	mp.arg = NULL;
 	mp.lookupflags = ACCEPT_PLAIN | ACCEPT_DIR;
-	exit(main_loop(&mp, argv + optind, argc - optind));
+	exit(close_drives(main_loop(&mp, argv + optind, argc - optind)));
 }
@@ -159,6 +159,15 @@ extern unsigned int mtools_twenty_four_hour_clock;
 extern const char *mtools_date_string;
 extern uint8_t mtools_rate_0, mtools_rate_any;
 extern unsigned int mtools_default_codepage;
+extern unsigned int mtools_fat_bulk_load;
+extern unsigned int mtools_lazy_fat_mirror;
+extern unsigned int mtools_prefetch_chain;
+extern unsigned int mtools_buffer_cache_size;
+extern unsigned int mtools_no_mmap;
+extern unsigned int mtools_io_uring;
+extern unsigned int mtools_copy_buffers;
+extern unsigned int mtools_copy_buffer_size;
+extern unsigned int mtools_sparse_image;
 extern int mtools_raw_tty;
 
 extern int batchmode;
@@ -53,6 +53,9 @@ int vfat_lookup_zt(direntry_t *entry, const char *filename,
 
 
 struct directory *dir_read(direntry_t *entry, int *error);
+struct dirCache_t;
+struct directory *dir_read_batch(direntry_t *entry, struct dirCache_t *cache,
+				 int *error);
 
 void initializeDirentry(direntry_t *entry, struct Stream_t *Dir);
 int isNotFound(direntry_t *entry);
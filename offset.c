@@ -41,6 +41,13 @@ static ssize_t offset_pwrite(Stream_t *Stream, char *buf,
 	return PWRITES(This->head.Next, buf, start+This->offset, len);
 }
 
+static int offset_get_raw_fd(Stream_t *Stream, mt_off_t *offset)
+{
+	DeclareThis(Offset_t);
+	*offset += This->offset;
+	return get_raw_fd(This->head.Next, offset);
+}
+
 static Class_t OffsetClass = {
 	0,
 	0,
@@ -53,6 +60,7 @@ static Class_t OffsetClass = {
 	0, /* pre-allocate */
 	get_dosConvert_pass_through, /* dos convert */
 	0, /* discard */
+	offset_get_raw_fd, /* get_raw_fd */
 };
 
 Stream_t *OpenOffset(Stream_t *Next, struct device *dev, off_t offset,
@@ -32,6 +32,8 @@ Buffer read/write module
 #include "partition.h"
 #include "offset.h"
 #include "swap.h"
+#include "mmap_io.h"
+#include "uring_io.h"
 
 /*
  * Open filesystem image
@@ -101,6 +103,18 @@ Stream_t *OpenImage(struct device *out_dev, struct device *dev,
 	if( !Stream)
 		return NULL;
 
+	if(mtools_io_uring && !mtools_sparse_image) {
+		Stream_t *Uring = OpenUring(Stream);
+		if(Uring != NULL)
+			Stream = Uring;
+	}
+
+	if(!mtools_no_mmap && !mtools_io_uring && !mtools_sparse_image) {
+		Stream_t *Mapped = OpenMmap(Stream);
+		if(Mapped != NULL)
+			Stream = Mapped;
+	}
+
 	if(dev->data_map) {
 		Stream_t *Remapped = Remap(Stream, out_dev, errmsg);
 		if(Remapped == NULL)
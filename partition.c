@@ -181,6 +181,13 @@ static int partition_geom(Stream_t *Stream, struct device *dev,
 	return 0;
 }
 
+static int partition_get_raw_fd(Stream_t *Stream, mt_off_t *offset)
+{
+	DeclareThis(Partition_t);
+	*offset += This->offset;
+	return get_raw_fd(This->head.Next, offset);
+}
+
 static Class_t PartitionClass = {
 	0,
 	0,
@@ -193,6 +200,7 @@ static Class_t PartitionClass = {
 	0, /* pre-allocate */
 	get_dosConvert_pass_through, /* dos convert */
 	0, /* discard */
+	partition_get_raw_fd, /* get_raw_fd */
 };
 
 Stream_t *OpenPartition(Stream_t *Next, struct device *dev,
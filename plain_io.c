@@ -23,6 +23,11 @@
  *
  */
 
+/* for fallocate() */
+#ifndef _GNU_SOURCE
+#define _GNU_SOURCE
+#endif
+
 #include "sysincludes.h"
 #include "stream.h"
 #include "mtools.h"
@@ -38,6 +43,12 @@ typedef struct SimpleFile_t {
     int fd;
     mt_off_t lastwhere;
     int seekable;
+    int positional; /* use pread/pwrite rather than lseek */
+    int noCopyRange; /* copy_file_range not supported for this file */
+    int noClone; /* FICLONERANGE not supported for this file */
+    int noKernelCopy; /* copy_from_fd not possible for this file */
+    int kernelCopied; /* copy_from_fd succeeded at least once */
+    int sparse; /* punch out blocks of zeroes (MTOOLS_SPARSE_IMAGE) */
     int privileged;
 #ifdef OS_hpux
     int size_limited;
@@ -48,15 +59,53 @@ typedef struct SimpleFile_t {
 
 #include "lockdev.h"
 
+#if defined HAVE_SYS_SYSCALL_H && defined HAVE_COPY_FILE_RANGE
+#include <sys/syscall.h>
+#endif
+#if defined HAVE_SYS_SENDFILE_H && defined HAVE_SENDFILE
+#include <sys/sendfile.h>
+#define USE_SENDFILE
+#endif
+#ifdef HAVE_LINUX_FS_H
+#include <linux/fs.h>
+#endif
+#if defined HAVE_FALLOCATE && defined FALLOC_FL_PUNCH_HOLE && \
+    defined FALLOC_FL_KEEP_SIZE
+#define HAVE_PUNCH_HOLE
+#endif
+
 typedef ssize_t (*iofn) (int, void *, size_t);
+#ifdef HAVE_POSITIONAL_IO
+typedef ssize_t (*piofn) (int, void *, size_t, off_t);
+#define IO(io, pio) io, pio
+#else
+typedef void *piofn;
+#define IO(io, pio) io, 0
+#endif
+
+/*
+ * Do the actual read or write.  If supported, positional I/O is used
+ * on seekable files, so that no separate seek is needed
+ */
+static ssize_t do_io(SimpleFile_t *This, char *buf,
+		     mt_off_t where, size_t len,
+		     iofn io, piofn pio UNUSEDP)
+{
+#ifdef HAVE_POSITIONAL_IO
+	if(This->positional)
+		return pio(This->fd, buf, len, (off_t) where);
+#endif
+	return io(This->fd, buf, len);
+}
 
 static ssize_t file_io(SimpleFile_t *This, char *buf,
 		       mt_off_t where, size_t len,
-		       iofn io)
+		       iofn io, piofn pio)
 {
 	ssize_t ret;
 
-	if (This->seekable && where != This->lastwhere ){
+	if (This->seekable && !This->positional &&
+	    where != This->lastwhere ){
 		if(mt_lseek( This->fd, where, SEEK_SET) < 0 ){
 			perror("seek");
 			return -1; /* If seek failed, lastwhere did
@@ -74,7 +123,7 @@ static ssize_t file_io(SimpleFile_t *This, char *buf,
 	if(This->size_limited && len > MAX_SCSI_LEN)
 		len = MAX_SCSI_LEN;
 #endif
-	ret = io(This->fd, buf, len);
+	ret = do_io(This, buf, where, len, io, pio);
 
 #ifdef OS_hpux
 	if (ret == -1 &&
@@ -82,7 +131,7 @@ static ssize_t file_io(SimpleFile_t *This, char *buf,
 		len > MAX_SCSI_LEN) {
 		This->size_limited = 1;
 		len = MAX_SCSI_LEN;
-		ret = io(This->fd, buf, len);
+		ret = do_io(This, buf, where, len, io, pio);
 	}
 #endif
 
@@ -94,30 +143,132 @@ static ssize_t file_io(SimpleFile_t *This, char *buf,
 	return ret;
 }
 
+/*
+ * Deallocate the whole blocks within the given range of fd, if it is a
+ * regular file.  Returns -1 if not possible
+ */
+int punch_hole(int fd, mt_off_t start, mt_off_t len)
+{
+#ifdef HAVE_PUNCH_HOLE
+	struct MT_STAT statbuf;
+	mt_off_t bs;
+	mt_off_t end;
+
+	if(MT_FSTAT(fd, &statbuf) < 0 || !S_ISREG(statbuf.st_mode))
+		return -1;
+	bs = statbuf.st_blksize > 0 ? statbuf.st_blksize : 512;
+	end = (start + len) / bs * bs;
+	start = (start + bs - 1) / bs * bs;
+	if(end <= start)
+		return 0;
+	return fallocate(fd, FALLOC_FL_PUNCH_HOLE | FALLOC_FL_KEEP_SIZE,
+			 (off_t) start, (off_t) (end - start));
+#else
+	return -1;
+#endif
+}
+
+#ifdef HAVE_PUNCH_HOLE
+static int isZero(const char *buf, size_t len)
+{
+	return !len || (!buf[0] && !memcmp(buf, buf+1, len-1));
+}
+
+/*
+ * Sparse mode: whole blocks of zeroes are not written, but punched out
+ * of the image, or, beyond its end, just covered by extending the file.
+ * Unaligned edges are written normally.  Returns -2 if the write should
+ * be done normally
+ */
+static ssize_t sparse_write(SimpleFile_t *This, char *buf,
+			    mt_off_t where, size_t len)
+{
+	struct MT_STAT statbuf;
+	mt_off_t bs = This->statbuf.st_blksize;
+	mt_off_t start = (where + bs - 1) / bs * bs;
+	mt_off_t end = (where + (mt_off_t) len) / bs * bs;
+	size_t head = (size_t) (start - where);
+	size_t tail;
+	ssize_t ret;
+
+	if(end <= start || !isZero(buf + head, (size_t) (end - start)) ||
+	   MT_FSTAT(This->fd, &statbuf) < 0)
+		return -2;
+
+	if(statbuf.st_size > start &&
+	   punch_hole(This->fd, start, end - start) < 0) {
+		/* not supported by this filesystem */
+		This->sparse = 0;
+		return -2;
+	}
+
+	if(head) {
+		ret = file_io(This, buf, where, head,
+			      IO((iofn) write, (piofn) pwrite));
+		if(ret < (ssize_t) head)
+			return ret;
+	}
+
+	if(statbuf.st_size < end && ftruncate(This->fd, (off_t) end) < 0) {
+		perror("extend sparse image");
+		return -1;
+	}
+	if(!This->positional && mt_lseek(This->fd, end, SEEK_SET) < 0) {
+		perror("seek");
+		return -1;
+	}
+	This->lastwhere = end;
+
+	tail = (size_t) (where + (mt_off_t) len - end);
+	if(tail) {
+		ret = file_io(This, buf + (end - where), end, tail,
+			      IO((iofn) write, (piofn) pwrite));
+		if(ret < 0)
+			return ret;
+		return (ssize_t) (end - where) + ret;
+	}
+	return (ssize_t) len;
+}
+#endif
+
+static ssize_t write_io(SimpleFile_t *This, char *buf,
+			mt_off_t where, size_t len)
+{
+#ifdef HAVE_PUNCH_HOLE
+	if(This->sparse) {
+		ssize_t ret = sparse_write(This, buf, where, len);
+		if(ret != -2)
+			return ret;
+	}
+#endif
+	return file_io(This, buf, where, len,
+		       IO((iofn) write, (piofn) pwrite));
+}
+
 static ssize_t file_read(Stream_t *Stream, char *buf, size_t len)
 {
 	DeclareThis(SimpleFile_t);
-	return file_io(This, buf, This->lastwhere, len, read);
+	return file_io(This, buf, This->lastwhere, len, IO(read, pread));
 }
 
 static ssize_t file_write(Stream_t *Stream, char *buf, size_t len)
 {
 	DeclareThis(SimpleFile_t);
-	return file_io(This, buf, This->lastwhere, len, (iofn) write);
+	return write_io(This, buf, This->lastwhere, len);
 }
 
 static ssize_t file_pread(Stream_t *Stream, char *buf,
 			  mt_off_t where, size_t len)
 {
 	DeclareThis(SimpleFile_t);
-	return file_io(This, buf, where, len, read);
+	return file_io(This, buf, where, len, IO(read, pread));
 }
 
 static ssize_t file_pwrite(Stream_t *Stream, char *buf,
 			   mt_off_t where, size_t len)
 {
 	DeclareThis(SimpleFile_t);
-	return file_io(This, buf, where, len, (iofn) write);
+	return write_io(This, buf, where, len);
 }
 
 static int file_flush(Stream_t *Stream UNUSEDP)
@@ -225,6 +376,12 @@ static int file_discard(Stream_t *Stream UNUSEDP)
 #endif
 }
 
+static int file_get_raw_fd(Stream_t *Stream, mt_off_t *offset UNUSEDP)
+{
+	DeclareThis(SimpleFile_t);
+	return This->fd;
+}
+
 static Class_t SimpleFileClass = {
 	file_read,
 	file_write,
@@ -236,7 +393,8 @@ static Class_t SimpleFileClass = {
 	file_data,
 	0, /* pre_allocate */
 	0, /* dos-convert */
-	file_discard
+	file_discard,
+	file_get_raw_fd
 };
 
 
@@ -441,6 +599,17 @@ APIRET rc;
 		*maxSize = max_off_t_seek;
 
 	This->lastwhere = 0;
+#ifdef HAVE_POSITIONAL_IO
+	/* only if off_t can address all of the device, and not on
+	 * pipes and the like, where pread fails with ESPIPE */
+	This->positional = sizeof(off_t) >= sizeof(mt_off_t) &&
+		This->seekable && lseek(This->fd, 0, SEEK_CUR) >= 0;
+#endif
+#ifdef HAVE_PUNCH_HOLE
+	/* images only, not files copied out of them */
+	This->sparse = mtools_sparse_image && dev &&
+		S_ISREG(This->statbuf.st_mode) && This->statbuf.st_blksize > 0;
+#endif
 
 	return &This->head;
  exit_0:
@@ -451,6 +620,184 @@ APIRET rc;
 	return NULL;
 }
 
+#ifdef FICLONERANGE
+/*
+ * Share the blocks of fdIn with the target (reflink), rather than
+ * copying them.  Only whole blocks of the target filesystem may be
+ * cloned, at the same alignment on both sides: an unaligned head is
+ * left to the caller by shortening *len to the next block boundary,
+ * as is a tail of less than a block.  Returns -2 if nothing was cloned
+ */
+static ssize_t clone_range(SimpleFile_t *This, int fdIn, mt_off_t offIn,
+			   size_t *len)
+{
+	struct file_clone_range range;
+	mt_off_t bs = This->statbuf.st_blksize;
+	size_t head;
+	size_t clen;
+
+	if(bs <= 0 || (offIn - This->lastwhere) % bs)
+		return -2;
+	head = (size_t) ((bs - This->lastwhere % bs) % bs);
+	if(head) {
+		if(*len > head)
+			*len = head;
+		return -2;
+	}
+	clen = *len - (size_t) (*len % (size_t) bs);
+	if(!clen)
+		return -2;
+
+	range.src_fd = fdIn;
+	range.src_offset = (__u64) offIn;
+	range.src_length = clen;
+	range.dest_offset = (__u64) This->lastwhere;
+	if(ioctl(This->fd, FICLONERANGE, &range) < 0) {
+		/* different filesystems, or no reflink support */
+		This->noClone = 1;
+		return -2;
+	}
+	return (ssize_t) clen;
+}
+#endif
+
+/*
+ * Whether copy_from_fd may work for Target: it must be a plain file,
+ * not opened for appending, which copy_file_range refuses
+ */
+int can_copy_from_fd(Stream_t *Stream)
+{
+	DeclareThis(SimpleFile_t);
+	int flags;
+
+	if(This->head.Class != &SimpleFileClass || This->noKernelCopy)
+		return 0;
+	if(This->kernelCopied)
+		return 1;
+	flags = fcntl(This->fd, F_GETFL);
+	if(flags < 0 || (flags & O_APPEND)) {
+		This->noKernelCopy = 1;
+		return 0;
+	}
+	return 1;
+}
+
+/*
+ * Append len bytes, read from offset offIn of file descriptor fdIn, to
+ * Target without passing them through user space.  Returns -2 if this
+ * is not possible (Target is not a plain file, or the kernel cannot do
+ * it for these files), in which case the caller should copy through a
+ * buffer instead.  Until a first copy succeeded, any error is taken
+ * to mean the latter
+ */
+ssize_t copy_from_fd(Stream_t *Stream, int fdIn, mt_off_t offIn, size_t len)
+{
+	ssize_t ret = -2;
+	DeclareThis(SimpleFile_t);
+
+	if(!can_copy_from_fd(Stream))
+		return -2;
+
+#ifdef FICLONERANGE
+	if(!This->noClone && S_ISREG(This->statbuf.st_mode)) {
+		ret = clone_range(This, fdIn, offIn, &len);
+		if(ret > 0) {
+			This->lastwhere += ret;
+			This->kernelCopied = 1;
+			return ret;
+		}
+	}
+#endif
+
+	/* both system calls below write at the current file position */
+	if(This->seekable && mt_lseek(This->fd, This->lastwhere, SEEK_SET) < 0)
+		return -2;
+
+#if defined __NR_copy_file_range
+	if(!This->noCopyRange) {
+		long long in = offIn;
+		ret = (ssize_t) syscall(__NR_copy_file_range,
+					fdIn, &in, This->fd, NULL, len, 0);
+		if(ret == 0 ||
+		   (ret < 0 && (!This->kernelCopied || errno == EXDEV ||
+				errno == EINVAL || errno == ENOSYS ||
+				errno == EOPNOTSUPP))) {
+			This->noCopyRange = 1;
+			ret = -2;
+		}
+	}
+#endif
+
+#ifdef USE_SENDFILE
+	if(ret == -2) {
+		off_t in = (off_t) offIn;
+		if((mt_off_t) in != offIn)
+			return -2;
+		ret = sendfile(This->fd, fdIn, &in, len);
+		if(ret == 0 ||
+		   (ret < 0 && (!This->kernelCopied || errno == EINVAL ||
+				errno == ENOSYS)))
+			ret = -2;
+	}
+#endif
+
+	if(ret == -2 && !This->kernelCopied)
+		This->noKernelCopy = 1;
+	if(ret > 0) {
+		This->lastwhere += ret;
+		This->kernelCopied = 1;
+	}
+	return ret;
+}
+
+/*
+ * If Stream is a plain file, skip over a hole at its current position.
+ * Returns the length of the hole skipped (0 if none), and sets *dataLen
+ * to the length of the data that follows, up to the next hole or the
+ * end of the file.  Returns -1 if holes cannot be detected for Stream
+ */
+mt_off_t skip_hole(Stream_t *Stream, mt_off_t *dataLen)
+{
+#if defined SEEK_DATA && defined SEEK_HOLE
+	DeclareThis(SimpleFile_t);
+	off_t data;
+	off_t hole;
+	mt_off_t skipped;
+
+	if(This->head.Class != &SimpleFileClass || !This->seekable ||
+	   !S_ISREG(This->statbuf.st_mode) ||
+	   sizeof(off_t) < sizeof(mt_off_t))
+		return -1;
+
+	data = lseek(This->fd, (off_t) This->lastwhere, SEEK_DATA);
+	if(data < 0) {
+		if(errno != ENXIO)
+			return -1;
+		/* nothing but a hole up to the end */
+		data = This->statbuf.st_size;
+		if(data < This->lastwhere)
+			data = (off_t) This->lastwhere;
+		hole = data;
+	} else {
+		hole = lseek(This->fd, data, SEEK_HOLE);
+		if(hole < 0) {
+			mt_lseek(This->fd, This->lastwhere, SEEK_SET);
+			return -1;
+		}
+	}
+	/* back to where reads expect to be */
+	if(lseek(This->fd, data, SEEK_SET) < 0)
+		return -1;
+
+	skipped = data - This->lastwhere;
+	This->lastwhere = data;
+	*dataLen = hole - data;
+	return skipped;
+#else
+	return -1;
+#endif
+}
+
 int get_fd(Stream_t *Stream)
 {
 	Class_t *clazz;
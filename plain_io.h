@@ -34,6 +34,10 @@ Stream_t *SimpleFileOpenWithLm(struct device *dev, struct device *orig_dev,
 int check_parameters(struct device *ref, struct device *testee);
 
 int get_fd(Stream_t *Stream);
+int punch_hole(int fd, mt_off_t start, mt_off_t len);
+mt_off_t skip_hole(Stream_t *Stream, mt_off_t *dataLen);
+int can_copy_from_fd(Stream_t *Target);
+ssize_t copy_from_fd(Stream_t *Target, int fdIn, mt_off_t offIn, size_t len);
 void *get_extra_data(Stream_t *Stream);
 
 int LockDevice(int fd, struct device *dev,
@@ -109,6 +109,7 @@ static Class_t RemapClass = {
 	0, /* pre-allocate */
 	get_dosConvert_pass_through, /* dos convert */
 	0, /* discard */
+	0, /* get_raw_fd */
 };
 
 static int process_map(Remap_t *This, const char *ptr,
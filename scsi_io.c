@@ -282,7 +282,8 @@ static Class_t ScsiDeviceClass = {
 	scsi_get_data, /* get_data */
 	0, /* pre-allocate */
 	0, /* dos-convert */
-	0 /* discard */
+	0, /* discard */
+	0 /* get_raw_fd */
 };
 
 Stream_t *OpenScsi(struct device *dev,
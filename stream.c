@@ -114,6 +114,25 @@ doscp_t *get_dosConvert_pass_through(Stream_t *Stream)
 	return GET_DOSCONVERT(Stream->Next);
 }
 
+/*
+ * File descriptor through which the data of Stream may be read
+ * directly, with *offset translated to the corresponding position in
+ * that descriptor.  Any data still buffered for writing is written
+ * first.  Returns -1 if there is no such descriptor, for instance
+ * because a layer transforms the data.
+ */
+int get_raw_fd(Stream_t *Stream, mt_off_t *offset)
+{
+	if(!Stream->Class->get_raw_fd)
+		return -1;
+	return Stream->Class->get_raw_fd(Stream, offset);
+}
+
+int get_raw_fd_pass_through(Stream_t *Stream, mt_off_t *offset)
+{
+	return get_raw_fd(Stream->Next, offset);
+}
+
 /*
  * Adjust number of total sectors by given offset in bytes
  */
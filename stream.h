@@ -31,6 +31,7 @@ typedef struct Stream_t {
 void limitSizeToOffT(size_t *len, mt_off_t maxLen);
 
 doscp_t *get_dosConvert_pass_through(Stream_t *Stream);
+int get_raw_fd_pass_through(Stream_t *Stream, mt_off_t *offset);
 
 typedef struct Class_t {
 	ssize_t (*read)(Stream_t *, char *, size_t);
@@ -46,6 +47,8 @@ typedef struct Class_t {
 	doscp_t *(*get_dosConvert)(Stream_t *);
 
 	int (*discard)(Stream_t *);
+
+	int (*get_raw_fd)(Stream_t *, mt_off_t *);
 } Class_t;
 
 #define READS(stream, buf, size) \
@@ -75,6 +78,8 @@ typedef struct Class_t {
 #define DISCARD(stream)			\
 	(stream)->Class->discard((stream))
 
+int get_raw_fd(Stream_t *Stream, mt_off_t *offset);
+
 int flush_stream(Stream_t *Stream);
 Stream_t *copy_stream(Stream_t *Stream);
 int free_stream(Stream_t **Stream);
@@ -116,5 +121,6 @@ int getfreeMinBytes(Stream_t *Stream, mt_off_t ref);
 int adjust_tot_sectors(struct device *dev, mt_off_t offset, char *errmsg);
 
 Stream_t *open_root_dir(char drivename, int flags, int *isRop);
+int close_drives(int ret);
 
 #endif
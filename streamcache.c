@@ -23,6 +23,7 @@
 #include "fs.h"
 #include "plain_io.h"
 #include "file.h"
+#include "uring_io.h"
 
 static int is_initialized = 0;
 static Stream_t *fss[256]; /* open drives */
@@ -73,3 +74,26 @@ Stream_t *open_root_dir(char drive, int flags, int *isRop)
 
 	return OpenRoot(Fs);
 }
+
+/* Close the open drives before exiting with status ret.  Writes
+ * queued through io_uring (MTOOLS_IO_URING) are only waited for
+ * here: if they fail, the status becomes 1 */
+int close_drives(int ret)
+{
+	int i;
+	Stream_t *Fs;
+
+	for(i=0; i<256; i++){
+		if(!fss[i] || fss[i]->refs != 1)
+			/* still in use, left to finish_sc */
+			continue;
+		/* writing back may exit(), don't free it twice */
+		Fs = fss[i];
+		fss[i] = NULL;
+		if(uring_close(&Fs) < 0) {
+			fprintf(stderr, "Error writing to drive %c:\n", i);
+			ret = 1;
+		}
+	}
+	return ret;
+}
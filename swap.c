@@ -77,6 +77,7 @@ static Class_t SwapClass = {
 	0, /* pre-allocate */
 	get_dosConvert_pass_through, /* dos convert */
 	0, /* discard */
+	0, /* get_raw_fd */
 };
 
 Stream_t *OpenSwap(Stream_t *Next) {
@@ -709,6 +709,10 @@ unsigned int sleep(unsigned int seconds);
 #define O_LARGEFILE 0
 #endif
 
+#if defined HAVE_PREAD && defined HAVE_PWRITE
+#define HAVE_POSITIONAL_IO
+#endif
+
 #if __GNUC__ > 4 || (__GNUC__ == 4 && __GNUC_MINOR__ >= 6) || defined(__clang__)
 # define HAVE_PRAGMA_DIAGNOSTIC 1
 #endif
@@ -0,0 +1,41 @@
+#!/bin/sh
+# Copy into an image from a pipe and from a named FIFO, which cannot
+# seek, and check that the data reads back unchanged.
+#
+# Usage: copy_from_pipe.sh [path to mtools]
+
+MTOOLS=${1:-./mtools}
+MTOOLSRC=/dev/null
+export MTOOLSRC
+
+dir=`mktemp -d ${TMPDIR:-/tmp}/mtools-test.XXXXXX` || exit 1
+trap 'rm -rf "$dir"' 0
+img=$dir/img
+data=$dir/data
+
+fail() {
+	echo "FAIL: $*" >&2
+	exit 1
+}
+
+dd if=/dev/zero of=$img bs=1024 count=1440 2>/dev/null
+$MTOOLS -c mformat -i $img -f 1440 :: || fail "mformat"
+i=0
+while [ $i -lt 3000 ]; do
+	echo "line $i of the test data"
+	i=`expr $i + 1`
+done > $data
+
+cat $data | $MTOOLS -c mcopy -i $img /dev/stdin ::pipe ||
+	fail "copy from /dev/stdin on a pipe"
+$MTOOLS -c mtype -i $img ::pipe | cmp -s - $data ||
+	fail "data copied from a pipe differs"
+
+mkfifo $dir/fifo || fail "mkfifo"
+cat $data > $dir/fifo &
+$MTOOLS -c mcopy -i $img $dir/fifo ::fifo || fail "copy from a FIFO"
+wait
+$MTOOLS -c mtype -i $img ::fifo | cmp -s - $data ||
+	fail "data copied from a FIFO differs"
+
+echo "PASS: copy_from_pipe"
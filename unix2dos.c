@@ -95,7 +95,8 @@ static Class_t FilterClass = {
 	get_data_pass_through,
 	0,
 	0, /* get_dosconvert */
-	0  /* discard */
+	0, /* discard */
+	0  /* get_raw_fd */
 };
 
 Stream_t *open_unix2dos(Stream_t *Next, int convertCharset UNUSEDP)
@@ -114,7 +114,8 @@ static Class_t DirClass = {
 	get_dir_data ,
 	0, /* pre-allocate */
 	0, /* get_dosConvert */
-	0 /* discard */
+	0, /* discard */
+	0 /* get_raw_fd */
 };
 
 int unix_dir_loop(Stream_t *Stream, MainParam_t *mp)
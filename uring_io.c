@@ -0,0 +1,510 @@
+/*  Copyright 2026 The mtools contributors.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ *
+ * Asynchronous access to images and devices using Linux io_uring.
+ *
+ * Writes are copied and queued, and the caller continues while they
+ * are in flight ("write behind").  Sequential reads cause the next
+ * stretch of the image to be read in the background.  Writes which
+ * overlap an operation still in flight wait for it first, so the
+ * order of overlapping accesses is kept.  Completions are collected
+ * right after each write is queued, so that a write failing at once
+ * is reported by the write which queued it.  Other errors of queued
+ * writes are reported by the next write, flush or free.
+ */
+
+#include "sysincludes.h"
+#include "mtools.h"
+#include "plain_io.h"
+#include "uring_io.h"
+
+#ifdef HAVE_LINUX_IO_URING_H
+#include <sys/syscall.h>
+#include <sys/mman.h>
+#include <linux/io_uring.h>
+#endif
+
+#if defined HAVE_LINUX_IO_URING_H && defined __NR_io_uring_setup && \
+	defined IORING_FEAT_RW_CUR_POS
+
+#define URING_ENTRIES 16
+#define URING_WRITES 8		/* writes in flight */
+#define URING_PREFETCH URING_WRITES /* index of prefetch request */
+#define URING_MAX_IO (1 << 20)	/* biggest single request */
+
+typedef struct UringReq_t {
+	char *buf;
+	size_t bufSize;
+	mt_off_t start;
+	size_t len;
+	int busy;		/* submitted, but not yet completed */
+	ssize_t res;
+} UringReq_t;
+
+typedef struct Uring_t {
+	struct Stream_t head;
+
+	int fd;			/* image */
+	int ringFd;
+
+	void *sqRing;
+	size_t sqRingSize;
+	unsigned int *sqTail;
+	unsigned int *sqMask;
+	unsigned int *sqArray;
+	struct io_uring_sqe *sqes;
+	size_t sqesSize;
+
+	void *cqRing;
+	size_t cqRingSize;
+	unsigned int *cqHead;
+	unsigned int *cqTail;
+	unsigned int *cqMask;
+	struct io_uring_cqe *cqes;
+
+	UringReq_t reqs[URING_WRITES + 1];
+	int error;		/* a queued write failed */
+
+	mt_off_t seqEnd;	/* end of last read */
+	size_t prefetchSize;
+} Uring_t;
+
+static int uring_enter(Uring_t *This, unsigned int toSubmit,
+		       unsigned int minComplete, unsigned int flags)
+{
+	int ret;
+
+	do {
+		ret = (int) syscall(__NR_io_uring_enter, This->ringFd,
+				    toSubmit, minComplete, flags, NULL, 0);
+	} while(ret < 0 && errno == EINTR);
+	return ret;
+}
+
+static int overlaps(UringReq_t *req, mt_off_t start, size_t len)
+{
+	return req->len &&
+		start < req->start + (mt_off_t) req->len &&
+		req->start < start + (mt_off_t) len;
+}
+
+/* A write completed.  Finish it if it was short */
+static void writeDone(Uring_t *This, UringReq_t *req)
+{
+	size_t done;
+
+	if(req->res < 0) {
+		errno = (int) -req->res;
+		perror("uring write");
+		This->error = 1;
+	} else if((size_t) req->res < req->len) {
+		done = (size_t) req->res;
+		if(force_pwrite(This->head.Next, req->buf + done,
+				req->start + (mt_off_t) done,
+				req->len - done) != (ssize_t) (req->len - done))
+			This->error = 1;
+	}
+	req->len = 0;
+}
+
+/* Collect completions, if wait is set wait for at least one */
+static int reap(Uring_t *This, int wait)
+{
+	unsigned int head, idx;
+	UringReq_t *req;
+
+	head = *This->cqHead;
+	if(head == __atomic_load_n(This->cqTail, __ATOMIC_ACQUIRE)) {
+		if(!wait)
+			return 0;
+		if(uring_enter(This, 0, 1, IORING_ENTER_GETEVENTS) < 0) {
+			perror("io_uring_enter");
+			exit(1);
+		}
+	}
+
+	while(head != __atomic_load_n(This->cqTail, __ATOMIC_ACQUIRE)) {
+		struct io_uring_cqe *cqe = &This->cqes[head & *This->cqMask];
+		idx = (unsigned int) cqe->user_data;
+		req = &This->reqs[idx];
+		req->res = cqe->res;
+		req->busy = 0;
+		if(idx != URING_PREFETCH)
+			writeDone(This, req);
+		head++;
+	}
+	__atomic_store_n(This->cqHead, head, __ATOMIC_RELEASE);
+	return 0;
+}
+
+static void waitReq(Uring_t *This, UringReq_t *req)
+{
+	while(req->busy)
+		reap(This, 1);
+}
+
+/* Wait for queued writes overlapping the given range */
+static void drainWrites(Uring_t *This, mt_off_t start, size_t len)
+{
+	int i;
+
+	for(i=0; i < URING_WRITES; i++)
+		if(This->reqs[i].busy && overlaps(&This->reqs[i], start, len))
+			waitReq(This, &This->reqs[i]);
+}
+
+static int growReqBuf(UringReq_t *req, size_t len)
+{
+	char *buf;
+
+	if(req->bufSize >= len)
+		return 0;
+	buf = realloc(req->buf, len);
+	if(!buf)
+		return -1;
+	req->buf = buf;
+	req->bufSize = len;
+	return 0;
+}
+
+static int submit(Uring_t *This, int op, UringReq_t *req)
+{
+	unsigned int tail, idx;
+	struct io_uring_sqe *sqe;
+
+	tail = *This->sqTail;
+	idx = tail & *This->sqMask;
+	sqe = &This->sqes[idx];
+	memset(sqe, 0, sizeof(*sqe));
+	sqe->opcode = (uint8_t) op;
+	sqe->fd = This->fd;
+	sqe->addr = (uint64_t) (uintptr_t) req->buf;
+	sqe->len = (uint32_t) req->len;
+	sqe->off = (uint64_t) req->start;
+	sqe->user_data = (uint64_t) (req - This->reqs);
+	This->sqArray[idx] = idx;
+	__atomic_store_n(This->sqTail, tail + 1, __ATOMIC_RELEASE);
+
+	req->busy = 1;
+	if(uring_enter(This, 1, 0, 0) != 1) {
+		/* not queued after all: undo */
+		__atomic_store_n(This->sqTail, tail, __ATOMIC_RELEASE);
+		req->busy = 0;
+		return -1;
+	}
+	return 0;
+}
+
+/* Start reading the next stretch of the image in the background */
+static void prefetch(Uring_t *This, mt_off_t start, size_t len)
+{
+	UringReq_t *req = &This->reqs[URING_PREFETCH];
+
+	waitReq(This, req);
+	if(growReqBuf(req, len) < 0)
+		return;
+	drainWrites(This, start, len);
+	req->start = start;
+	req->len = len;
+	if(submit(This, IORING_OP_READ, req) < 0)
+		req->len = 0;
+}
+
+static ssize_t uring_pread(Stream_t *Stream, char *buf,
+			   mt_off_t start, size_t len)
+{
+	DeclareThis(Uring_t);
+	UringReq_t *req = &This->reqs[URING_PREFETCH];
+	ssize_t ret = -1;
+	size_t offset;
+
+	if(overlaps(req, start, 1)) {
+		waitReq(This, req);
+		offset = (size_t) (start - req->start);
+		if(req->res > (ssize_t) offset) {
+			maximize(len, (size_t) req->res - offset);
+			memcpy(buf, req->buf + offset, len);
+			ret = (ssize_t) len;
+		}
+		req->len = 0;
+	}
+
+	if(ret < 0) {
+		drainWrites(This, start, len);
+		ret = PREADS(This->head.Next, buf, start, len);
+		if(ret <= 0)
+			return ret;
+	}
+
+	if(start == This->seqEnd) {
+		/* sequential: keep the next read in flight, and read
+		 * more at once the longer this goes on */
+		if(This->prefetchSize < (size_t) ret)
+			This->prefetchSize = (size_t) ret;
+		else if(This->prefetchSize < URING_MAX_IO)
+			This->prefetchSize *= 2;
+		maximize(This->prefetchSize, URING_MAX_IO);
+		prefetch(This, start + ret, This->prefetchSize);
+	} else
+		This->prefetchSize = 0;
+	This->seqEnd = start + ret;
+	return ret;
+}
+
+static ssize_t uring_pwrite(Stream_t *Stream, char *buf,
+			    mt_off_t start, size_t len)
+{
+	DeclareThis(Uring_t);
+	UringReq_t *req;
+	int i;
+
+	reap(This, 0);
+	if(This->error) {
+		errno = EIO;
+		return -1;
+	}
+
+	maximize(len, URING_MAX_IO);
+	req = &This->reqs[URING_PREFETCH];
+	if(overlaps(req, start, len)) {
+		/* prefetched data about to become stale */
+		waitReq(This, req);
+		req->len = 0;
+	}
+	drainWrites(This, start, len);
+
+	while(1) {
+		for(i=0; i < URING_WRITES; i++)
+			if(!This->reqs[i].busy)
+				break;
+		if(i < URING_WRITES)
+			break;
+		reap(This, 1);
+	}
+	req = &This->reqs[i];
+	if(growReqBuf(req, len) < 0)
+		return PWRITES(This->head.Next, buf, start, len);
+
+	memcpy(req->buf, buf, len);
+	req->start = start;
+	req->len = len;
+	if(submit(This, IORING_OP_WRITE, req) < 0) {
+		req->len = 0;
+		return PWRITES(This->head.Next, buf, start, len);
+	}
+	reap(This, 0);
+	if(This->error) {
+		errno = EIO;
+		return -1;
+	}
+	return (ssize_t) len;
+}
+
+static void drainAll(Uring_t *This)
+{
+	int i;
+
+	for(i=0; i <= URING_WRITES; i++)
+		waitReq(This, &This->reqs[i]);
+}
+
+static int uring_flush(Stream_t *Stream)
+{
+	DeclareThis(Uring_t);
+
+	drainAll(This);
+	if(This->error)
+		return -1;
+	return 0;
+}
+
+static int uring_free(Stream_t *Stream)
+{
+	DeclareThis(Uring_t);
+	int i;
+
+	drainAll(This);
+	for(i=0; i <= URING_WRITES; i++)
+		if(This->reqs[i].buf)
+			free(This->reqs[i].buf);
+	munmap(This->sqes, This->sqesSize);
+	if(This->cqRing != This->sqRing)
+		munmap(This->cqRing, This->cqRingSize);
+	munmap(This->sqRing, This->sqRingSize);
+	close(This->ringFd);
+	return This->error ? -1 : 0;
+}
+
+static int uring_discard(Stream_t *Stream)
+{
+	DeclareThis(Uring_t);
+
+	drainAll(This);
+	if(This->error)
+		return -1;
+	if(This->head.Next->Class->discard)
+		return DISCARD(This->head.Next);
+	return 0;
+}
+
+static int uring_get_raw_fd(Stream_t *Stream, mt_off_t *offset)
+{
+	if(uring_flush(Stream) < 0)
+		return -1;
+	return get_raw_fd_pass_through(Stream, offset);
+}
+
+static Class_t UringClass = {
+	0,
+	0,
+	uring_pread,
+	uring_pwrite,
+	uring_flush,
+	uring_free,
+	set_geom_pass_through, /* set_geom */
+	get_data_pass_through, /* get_data */
+	0, /* pre-allocate */
+	get_dosConvert_pass_through, /* dos convert */
+	uring_discard, /* discard */
+	uring_get_raw_fd, /* get_raw_fd */
+};
+
+static int setupRing(Uring_t *This)
+{
+	struct io_uring_params p;
+	char *sq, *cq;
+
+	memset(&p, 0, sizeof(p));
+	This->ringFd = (int) syscall(__NR_io_uring_setup, URING_ENTRIES, &p);
+	if(This->ringFd < 0)
+		return -1;
+	if(!(p.features & IORING_FEAT_RW_CUR_POS)) {
+		/* too old for IORING_OP_READ and IORING_OP_WRITE */
+		close(This->ringFd);
+		return -1;
+	}
+
+	This->sqRingSize = p.sq_off.array + p.sq_entries * sizeof(unsigned int);
+	This->cqRingSize = p.cq_off.cqes +
+		p.cq_entries * sizeof(struct io_uring_cqe);
+	if(p.features & IORING_FEAT_SINGLE_MMAP) {
+		if(This->cqRingSize > This->sqRingSize)
+			This->sqRingSize = This->cqRingSize;
+		This->cqRingSize = This->sqRingSize;
+	}
+
+	This->sqRing = mmap(NULL, This->sqRingSize, PROT_READ | PROT_WRITE,
+			    MAP_SHARED | MAP_POPULATE, This->ringFd,
+			    IORING_OFF_SQ_RING);
+	if(This->sqRing == MAP_FAILED)
+		goto exit_0;
+	if(p.features & IORING_FEAT_SINGLE_MMAP)
+		This->cqRing = This->sqRing;
+	else {
+		This->cqRing = mmap(NULL, This->cqRingSize,
+				    PROT_READ | PROT_WRITE,
+				    MAP_SHARED | MAP_POPULATE, This->ringFd,
+				    IORING_OFF_CQ_RING);
+		if(This->cqRing == MAP_FAILED)
+			goto exit_1;
+	}
+	This->sqesSize = p.sq_entries * sizeof(struct io_uring_sqe);
+	This->sqes = mmap(NULL, This->sqesSize, PROT_READ | PROT_WRITE,
+			  MAP_SHARED | MAP_POPULATE, This->ringFd,
+			  IORING_OFF_SQES);
+	if(This->sqes == MAP_FAILED)
+		goto exit_2;
+
+	sq = This->sqRing;
+	This->sqTail = (unsigned int *) (sq + p.sq_off.tail);
+	This->sqMask = (unsigned int *) (sq + p.sq_off.ring_mask);
+	This->sqArray = (unsigned int *) (sq + p.sq_off.array);
+	cq = This->cqRing;
+	This->cqHead = (unsigned int *) (cq + p.cq_off.head);
+	This->cqTail = (unsigned int *) (cq + p.cq_off.tail);
+	This->cqMask = (unsigned int *) (cq + p.cq_off.ring_mask);
+	This->cqes = (struct io_uring_cqe *) (cq + p.cq_off.cqes);
+	return 0;
+
+ exit_2:
+	if(This->cqRing != This->sqRing)
+		munmap(This->cqRing, This->cqRingSize);
+ exit_1:
+	munmap(This->sqRing, This->sqRingSize);
+ exit_0:
+	close(This->ringFd);
+	return -1;
+}
+
+Stream_t *OpenUring(Stream_t *Next)
+{
+	Uring_t *This;
+	int fd;
+
+	fd = get_fd(Next);
+	if(fd < 0 || lseek(fd, 0, SEEK_CUR) < 0)
+		/* not seekable */
+		return NULL;
+
+	This = New(Uring_t);
+	if (!This)
+		return NULL;
+	This->fd = fd;
+	if(setupRing(This) < 0) {
+		Free(This);
+		return NULL;
+	}
+	init_head(&This->head, &UringClass, Next);
+	return &This->head;
+}
+
+int uring_close(Stream_t **Stream)
+{
+	Stream_t *s;
+	Uring_t *This;
+	int ret;
+
+	for(s = *Stream; s; s = s->Next)
+		if(s->Class == &UringClass)
+			break;
+	if(!s) {
+		FREE(Stream);
+		return 0;
+	}
+	/* keep the ring until the layers above have written back */
+	copy_stream(s);
+	FREE(Stream);
+	This = (Uring_t *) s;
+	drainAll(This);
+	ret = This->error ? -1 : 0;
+	FREE(&s);
+	return ret;
+}
+
+#else
+
+Stream_t *OpenUring(Stream_t *Next UNUSEDP)
+{
+	return NULL;
+}
+
+int uring_close(Stream_t **Stream)
+{
+	FREE(Stream);
+	return 0;
+}
+
+#endif
@@ -0,0 +1,32 @@
+#ifndef MTOOLS_URING_IO_H
+#define MTOOLS_URING_IO_H
+
+/*  Copyright 2026 The mtools contributors.
+ *  This file is part of mtools.
+ *
+ *  Mtools is free software: you can redistribute it and/or modify
+ *  it under the terms of the GNU General Public License as published by
+ *  the Free Software Foundation, either version 3 of the License, or
+ *  (at your option) any later version.
+ *
+ *  Mtools is distributed in the hope that it will be useful,
+ *  but WITHOUT ANY WARRANTY; without even the implied warranty of
+ *  MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+ *  GNU General Public License for more details.
+ *
+ *  You should have received a copy of the GNU General Public License
+ *  along with Mtools.  If not, see <http://www.gnu.org/licenses/>.
+ */
+
+#include "stream.h"
+
+/* Do the I/O of the plain file or device Next through io_uring.
+ * Returns NULL if Next is not a plain seekable file, or if io_uring
+ * is not available */
+Stream_t *OpenUring(Stream_t *Next);
+
+/* Free Stream.  Returns -1 if writes it queued through io_uring,
+ * which are only waited for here, failed */
+int uring_close(Stream_t **Stream);
+
+#endif
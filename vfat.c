@@ -355,7 +355,7 @@ void dir_write(direntry_t *entry)
 		fprintf(stderr, "Out of memory error in dir_write\n");
 		exit(1);
 	}
-	dce = cache->entries[entry->entry];
+	dce = lookupInDircache(cache, (unsigned int) entry->entry);
 	if(dce) {
 		if(entry->dir.name[0] == DELMARK) {
 			addFreeEntry(cache, dce->beginSlot, dce->endSlot);
@@ -461,7 +461,7 @@ static dirCacheEntry_t *vfat_lookup_loop_common(doscp_t *cp,
 	clear_vfat(&vfat);
 	while(1) {
 		++direntry->entry;
-		if(!dir_read(direntry, &error)){
+		if(!dir_read_batch(direntry, cache, &error)){
 			if(error) {
 			    *io_error = error;
 			    return NULL;
@@ -543,7 +543,7 @@ static inline dirCacheEntry_t *vfat_lookup_loop_for_read(doscp_t *cp,
 	dirCacheEntry_t *dce;
 
 	*io_error = 0;
-	dce = cache->entries[initpos];
+	dce = lookupInDircache(cache, (unsigned int) initpos);
 	if(dce) {
 		setEntryToPos(direntry, dce->endSlot - 1);
 		return dce;
@@ -554,6 +554,44 @@ static inline dirCacheEntry_t *vfat_lookup_loop_for_read(doscp_t *cp,
 }
 
 
+/*
+ * Read the rest of the directory into the cache, so that its name
+ * index covers all of it.  Returns 0 if the index can be used
+ */
+static int completeDirCache(doscp_t *cp, Stream_t *Dir, dirCache_t *cache)
+{
+	direntry_t entry;
+	unsigned int pos;
+	int io_error;
+
+	initializeDirentry(&entry, Dir);
+	while(!dirCacheComplete(cache)) {
+		if(cache->indexFailed)
+			return -1;
+		pos = cache->nrCached;
+		setEntryForIteration(&entry, pos);
+		if(!vfat_lookup_loop_common(cp, &entry, cache, 0, &io_error) ||
+		   cache->nrCached <= pos)
+			/* let the slow path deal with it */
+			return -1;
+	}
+	return 0;
+}
+
+/* Name without wildcards, which can be looked up in the index? */
+static int isLiteralName(const wchar_t *name, size_t length)
+{
+	size_t i;
+
+	if(!length)
+		return 0;
+	for(i=0; i < length; i++)
+		if(name[i] == '*' || name[i] == '?' ||
+		   name[i] == '[' || name[i] == '\\')
+			return 0;
+	return 1;
+}
+
 typedef enum result_t {
 	RES_NOMATCH,
 	RES_MATCH,
@@ -673,7 +711,22 @@ int vfat_lookup(direntry_t *direntry, const char *filename,
 		exit(1);
 	}
 
-	do {
+	if(!(flags & MATCH_ANY) && isLiteralName(wfilename, length) &&
+	   !completeDirCache(cp, direntry->Dir, cache)) {
+		/* only entries carrying this very name need checking */
+		result = RES_END;
+		while((dce = lookupNameInDircache(cache, wfilename,
+						  direntry->entry,
+						  DC_LONG | DC_SHORT))) {
+			setEntryToPos(direntry, dce->endSlot - 1);
+			result = checkNameForMatch(direntry, dce,
+						   wfilename,
+						   (int) length, flags);
+			if(result != RES_NOMATCH)
+				break;
+			result = RES_END;
+		}
+	} else do {
 		dce = vfat_lookup_loop_for_read(cp, direntry, cache, &io_error);
 		if(!dce) {
 			if (io_error)
@@ -714,7 +767,7 @@ static inline dirCacheEntry_t *vfat_lookup_loop_for_insert(doscp_t *cp,
 	dirCacheEntry_t *dce;
 	int io_error;
 
-	dce = cache->entries[initpos];
+	dce = lookupInDircache(cache, initpos);
 	if(dce && dce->type != DCET_END) {
 		return dce;
 	} else {
@@ -729,7 +782,7 @@ static inline dirCacheEntry_t *vfat_lookup_loop_for_insert(doscp_t *cp,
 				"Out of memory error in vfat_lookup_loop\n");
 			exit(1);
 		}
-		return cache->entries[initpos];
+		return lookupInDircache(cache, initpos);
 	}
 }
 
@@ -778,6 +831,8 @@ int lookupForInsert(Stream_t *Dir,
 {
 	direntry_t entry;
 	int ignore_match;
+	int useIndex;
+	int filterHit = 0; /* which name the filter said might exist */
 	dirCacheEntry_t *dce;
 	dirCache_t *cache;
 	unsigned int pos; /* position _before_ the next answered entry */
@@ -805,15 +860,63 @@ int lookupForInsert(Stream_t *Dir,
 	if(!ignore_match)
 		unix_name(cp, dosname->base, dosname->ext, 0, shortName);
 
+	/* With the whole directory indexed, clashes are looked up by
+	 * name, and only free slots remain to be scanned for */
+	useIndex = !completeDirCache(cp, Dir, cache);
+	if(useIndex) {
+		/* same answers as the scan below: it stops at the first
+		 * long match, having noted the short clashes before it */
+		dirCacheEntry_t *longDce = NULL;
+		for(dce = lookupNameInDircache(cache, wlongname, -1,
+					       DC_LONG | DC_SHORT);
+		    dce;
+		    dce = lookupNameInDircache(cache, wlongname,
+					       (int) dce->endSlot - 1,
+					       DC_LONG | DC_SHORT)) {
+			if(!(dce->dir.attr & 0x8) &&
+			   (signed int)dce->endSlot-1 != ignore_entry) {
+				longDce = dce;
+				break;
+			}
+		}
+		if(!ignore_match)
+			for(dce = lookupNameInDircache(cache, shortName, -1,
+						       DC_SHORT);
+			    dce && (!longDce ||
+				    dce->endSlot < longDce->endSlot);
+			    dce = lookupNameInDircache(cache, shortName,
+						       (int) dce->endSlot - 1,
+						       DC_SHORT))
+				if(!(dce->dir.attr & 0x8) &&
+				   (signed int)dce->endSlot-1 != ignore_entry)
+					ssp->shortmatch =
+						(int) (dce->endSlot - 1);
+		if(longDce) {
+			ssp->longmatch = (int) (longDce->endSlot - 1);
+			direntry->beginSlot = longDce->beginSlot;
+			direntry->endSlot = longDce->endSlot - 1;
+			return 1;
+		}
+		if(ssp->shortmatch > -1) {
+			if(pessimisticShortRename)
+				ssp->shortmatch = -2;
+			return 1;
+		}
+	}
+
 	pos = cache->nrHashed;
-	if(source_entry >= 0 ||
-	   (pos && isHashed(cache, wlongname))) {
+	if(source_entry >= 0) {
+		pos = 0;
+	} else if(!useIndex && pos && isHashed(cache, wlongname)) {
+		filterHit = DC_LONG;
 		pos = 0;
-	} else if(pos && !ignore_match && isHashed(cache, shortName)) {
+	} else if(!useIndex &&
+		  pos && !ignore_match && isHashed(cache, shortName)) {
 		if(pessimisticShortRename) {
 			ssp->shortmatch = -2;
 			return 1;
 		}
+		filterHit = DC_SHORT;
 		pos = 0;
 	} else if(growDirCache(cache, pos) < 0) {
 		fprintf(stderr, "Out of memory error in vfat_looup [0]\n");
@@ -831,8 +934,9 @@ int lookupForInsert(Stream_t *Dir,
 				   accountFreeSlots(ssp, dce);
 
 				/* labels never match, neither does the
-				 * ignored entry */
-				if( (dce->dir.attr & 0x8) ||
+				 * ignored entry.  With the index, clashes
+				 * have already been checked */
+				if( useIndex || (dce->dir.attr & 0x8) ||
 				    ((signed int)dce->endSlot-1==ignore_entry))
 					break;
 
@@ -862,6 +966,13 @@ int lookupForInsert(Stream_t *Dir,
 		}
 		pos = dce->endSlot;
 	} while(dce->type != DCET_END);
+	/* the scan tells whether the filter was right.  A long match
+	 * would have returned above */
+	if(filterHit)
+		cache->nrFilterHits++;
+	if(filterHit == DC_LONG ||
+	   (filterHit == DC_SHORT && ssp->shortmatch == -1))
+		cache->nrFilterFalse++;
 	if (ssp->shortmatch > -1)
 		return 1;
 	ssp->max_entry = dce->beginSlot;
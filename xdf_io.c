@@ -627,7 +627,8 @@ static Class_t XdfClass = {
 	0, /* get_data */
 	0, /* pre-allocate */
 	0, /* get_dosConvert */
-	0 /* discard */
+	0, /* discard */
+	0 /* get_raw_fd */
 };
 
 Stream_t *XdfOpen(struct device *dev, const char *name,